@@ -0,0 +1,576 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+#include "lexer.hpp"
+#include "parser.hpp"
+#include "optimizer.hpp"
+#include "generator.hpp"
+#include "incremental.hpp"
+
+#include "synth.hpp"
+
+static const int phase_count = 4;
+
+struct SizeResult {
+    uint64_t bytes;
+    uint64_t tokens;
+    uint64_t nodes;
+
+    // fastest run of each phase
+    double milliseconds[phase_count];
+};
+
+const char* phase_names[phase_count] = { "tokenize", "parse", "optimize", "generate" };
+
+uint64_t parse_size(const char* text)
+{
+    char* end = nullptr;
+    double value = strtod(text, &end);
+
+    if (*end == 'k' || *end == 'K') {
+        value *= 1024;
+    } else if (*end == 'm' || *end == 'M') {
+        value *= 1024 * 1024;
+    } else if (*end == 'g' || *end == 'G') {
+        value *= 1024 * 1024 * 1024;
+    }
+
+    return (uint64_t) value;
+}
+
+std::string format_size(uint64_t bytes)
+{
+    char buffer[32];
+
+    if (bytes >= 1024 * 1024) {
+        snprintf(buffer, sizeof(buffer), "%lluM", (unsigned long long) (bytes / (1024 * 1024)));
+    } else if (bytes >= 1024) {
+        snprintf(buffer, sizeof(buffer), "%lluK", (unsigned long long) (bytes / 1024));
+    } else {
+        snprintf(buffer, sizeof(buffer), "%lluB", (unsigned long long) bytes);
+    }
+
+    return buffer;
+}
+
+double throughput(uint64_t bytes, double milliseconds)
+{
+    if (milliseconds <= 0) {
+        return 0;
+    }
+
+    return (bytes / (1024.0 * 1024.0)) / (milliseconds / 1000.0);
+}
+
+double elapsed_milliseconds(std::chrono::high_resolution_clock::time_point start)
+{
+    auto elapsed = std::chrono::high_resolution_clock::now() - start;
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / 1000000.0;
+}
+
+SizeResult run_size(uint64_t target_bytes, const SynthOptions& options, int repeat)
+{
+    std::string program = synthesize_program(target_bytes, options);
+
+    SizeResult result = {};
+    result.bytes = program.size();
+
+    for (int phase = 0; phase < phase_count; phase++) {
+        result.milliseconds[phase] = 1e300;
+    }
+
+    // keep the fastest run of each phase, the slower ones are mostly noise
+    for (int run = 0; run < repeat; run++) {
+        auto start = std::chrono::high_resolution_clock::now();
+        std::vector<Token> tokens = tokenize(program);
+        double tokenize_ms = elapsed_milliseconds(start);
+
+        start = std::chrono::high_resolution_clock::now();
+        auto root = parse(&tokens);
+        double parse_ms = elapsed_milliseconds(start);
+
+        result.nodes = count_nodes(root);
+
+        // the same passes compile runs, warnings included
+        start = std::chrono::high_resolution_clock::now();
+        std::vector<std::string> diagnostics;
+        optimize(root, diagnostics);
+        double optimize_ms = elapsed_milliseconds(start);
+
+        start = std::chrono::high_resolution_clock::now();
+        // laying the tree out is part of getting it to the generator
+        FlatAST ast;
+        flatten(root, diagnostics, SourceStamp(), ast);
+
+        Emitter buffer;
+        generate(ast, buffer);
+        double generate_ms = elapsed_milliseconds(start);
+
+        result.tokens = tokens.size();
+
+        double measured[phase_count] = { tokenize_ms, parse_ms, optimize_ms, generate_ms };
+
+        for (int phase = 0; phase < phase_count; phase++) {
+            if (measured[phase] < result.milliseconds[phase]) {
+                result.milliseconds[phase] = measured[phase];
+            }
+        }
+    }
+
+    return result;
+}
+
+// where the token at index starts, for tokens whose length is known
+int token_start(const Document& document, int index, int length)
+{
+    return document.token_ends[index].offset - length;
+}
+
+// a top level assignment wrapped in an if, which moves it into a block
+Edit wrap_assignment(Random& random, const Document& document)
+{
+    const auto& statements = document.root->children;
+    int count = (int) statements.size();
+    int from = count == 0 ? 0 : random.below(count);
+
+    int first = 0;
+    std::vector<int> starts;
+    for (const auto& statement : statements) {
+        starts.push_back(first);
+        first += statement->tokens;
+    }
+
+    for (int i = 0; i < count; i++) {
+        int index = (from + i) % count;
+        if (statements[index]->type != NodeType::Assignment) {
+            continue;
+        }
+
+        const Token& target = document.tokens[starts[index]];
+        int begin = token_start(document, starts[index], (int) target.value.size());
+        int end = document.token_ends[starts[index] + statements[index]->tokens - 1].offset;
+
+        return { begin, end - begin, "if (1 > 0) {\n" + document.contents.substr(begin, end - begin) + "\n}" };
+    }
+
+    return { 0, 0, "if (1 > 0) {\n}\n" };
+}
+
+// a small edit like one from an editor. some keep the program valid: a
+// literal changed, an assignment target renamed, a statement added in front
+// of an assignment or an assignment moved into an if. the others change its
+// structure the way typing does on the way to the next valid program: a brace
+// or an if header added or removed, a string or a comment opened, or a span
+// across several tokens deleted. run_edits takes back the ones that break it
+Edit synthesize_edit(Random& random, const Document& document, int serial)
+{
+    int kind = random.below(8);
+    int count = (int) document.tokens.size();
+    int from = random.below(count);
+
+    if (kind == 3) {
+        return wrap_assignment(random, document);
+    }
+
+    Edit edit = { 0, 0, "" };
+
+    // anything but EOF, the edit goes right after it
+    if (kind >= 6) {
+        int index = random.below(count - 1 > 0 ? count - 1 : 1);
+        edit.offset = count > 1 ? document.token_ends[index].offset : 0;
+
+        if (kind == 6) {
+            edit.inserted = random.below(2) == 0 ? " \"" : " // ";
+        } else {
+            edit.removed = std::min(1 + random.below(24), (int) document.contents.size() - edit.offset);
+        }
+
+        return edit;
+    }
+
+    bool remove = random.below(2) == 0;
+
+    for (int i = 0; i < count; i++) {
+        int index = (from + i) % count;
+        const Token& token = document.tokens[index];
+
+        bool literal = token.type == TokenType::INT_LIT;
+        bool target = token.type == TokenType::IDENTIFIER && document.tokens[index + 1].type == TokenType::ASSIGNMENT;
+
+        if (kind == 4) {
+            if (token.type != TokenType::RIGHT_BRACE && (remove || token.type == TokenType::_EOF)) {
+                continue;
+            }
+
+            if (remove) {
+                edit.offset = token_start(document, index, 1);
+                edit.removed = 1;
+            } else {
+                edit.offset = document.token_ends[index].offset;
+                edit.inserted = "\n}";
+            }
+
+            return edit;
+        }
+
+        if (kind == 5) {
+            if (remove ? token.type != TokenType::IF : !target) {
+                continue;
+            }
+
+            if (remove) {
+                // the header up to and including its opening brace
+                int brace = index;
+                while (document.tokens[brace].type != TokenType::LEFT_BRACE) {
+                    brace++;
+                }
+
+                edit.offset = token_start(document, index, 2);
+                edit.removed = document.token_ends[brace].offset - edit.offset;
+            } else {
+                edit.offset = token_start(document, index, (int) token.value.size());
+                edit.inserted = "if (v" + std::to_string(random.below(8)) + " > 0) {\n";
+            }
+
+            return edit;
+        }
+
+        if (kind == 0 ? !literal : !target) {
+            continue;
+        }
+
+        edit.offset = token_start(document, index, (int) token.value.size());
+
+        if (kind == 0) {
+            edit.removed = (int) token.value.size();
+            edit.inserted = std::to_string(1 + random.below(999));
+        } else if (kind == 1) {
+            edit.removed = (int) token.value.size();
+            edit.inserted = "v" + std::to_string(random.below(8));
+        } else {
+            edit.inserted = "e" + std::to_string(serial) + " = " + std::to_string(1 + random.below(999)) + "\n";
+        }
+
+        return edit;
+    }
+
+    // nothing to change, start the program with a statement instead
+    edit.inserted = "e" + std::to_string(serial) + " = 1\n";
+    return edit;
+}
+
+bool same_tree(const std::shared_ptr<ASTNode>& left, const std::shared_ptr<ASTNode>& right)
+{
+    if (left->type != right->type || left->value != right->value || left->number != right->number || left->tokens != right->tokens || left->children.size() != right->children.size()) {
+        return false;
+    }
+
+    for (size_t i = 0; i < left->children.size(); i++) {
+        if (!same_tree(left->children[i], right->children[i])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool same_tokens(const Document& document, const Document& reference)
+{
+    if (document.tokens.size() != reference.tokens.size()) {
+        return false;
+    }
+
+    for (size_t i = 0; i < document.tokens.size(); i++) {
+        const Token& left = document.tokens[i];
+        const Token& right = reference.tokens[i];
+        const LexerState& left_end = document.token_ends[i];
+        const LexerState& right_end = reference.token_ends[i];
+
+        if (left.type != right.type || left.value != right.value || left.line != right.line || left.character != right.character
+            || (left.type == TokenType::INT_LIT && left.number != right.number)
+            || left_end.offset != right_end.offset || left_end.line != right_end.line || left_end.character != right_end.character) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+double percentile(std::vector<double> values, double fraction)
+{
+    std::sort(values.begin(), values.end());
+    return values[(size_t) (fraction * (values.size() - 1))];
+}
+
+// applies seeded edits one after the other and checks each result against
+// lexing and parsing the whole program again, whose time is the comparison
+int run_edits(uint64_t target_bytes, const SynthOptions& options, int count)
+{
+    Document document;
+    open_document(document, synthesize_program(target_bytes, options));
+
+    Random random = { options.seed };
+    std::vector<double> incremental;
+    std::vector<double> full;
+    long long tokens_lexed = 0;
+    long long statements_parsed = 0;
+
+    int damaged = 0;
+    Edit undo;
+
+    for (int i = 0; i < count; i++) {
+        // a program that doesn't parse gets the edit that broke it taken
+        // back, the way the next keystrokes would have made it valid again
+        Edit edit = document.error.empty() ? synthesize_edit(random, document, i) : undo;
+        undo = { edit.offset, (int) edit.inserted.size(), document.contents.substr(edit.offset, edit.removed) };
+
+        EditTiming timing;
+        EditResult result = apply_edit(document, edit, timing);
+        damaged += result == EditDamaged;
+
+        if (result == EditOutOfRange) {
+            printf("\x1b[31m[mismatch]\033[0m edit %d reaches outside of the program.\n", i);
+            return EXIT_FAILURE;
+        }
+
+        incremental.push_back((timing.lex_microseconds + timing.parse_microseconds) / 1000.0);
+        tokens_lexed += timing.tokens_lexed;
+        statements_parsed += timing.statements_parsed;
+
+        auto start = std::chrono::high_resolution_clock::now();
+        std::vector<Token> tokens = tokenize(document.contents);
+        parse(&tokens);
+        full.push_back(elapsed_milliseconds(start));
+
+        Document reference;
+        open_document(reference, document.contents);
+
+        // a source that doesn't parse has to give the same error either way,
+        // the tokens and the tree aren't kept up to date then
+        if (document.error != reference.error) {
+            printf("\x1b[31m[mismatch]\033[0m edit %d left a different error than a full parse.\n", i);
+            return EXIT_FAILURE;
+        }
+
+        if (result == EditApplied && (!same_tokens(document, reference) || !same_tree(document.root, reference.root))) {
+            printf("\x1b[31m[mismatch]\033[0m edit %d left different tokens or a different tree than a full parse.\n", i);
+            return EXIT_FAILURE;
+        }
+    }
+
+    printf("%d edits on a %s program, %llu tokens\n", count, format_size(target_bytes).c_str(), (unsigned long long) document.tokens.size());
+    printf("%12s %10s %10s %10s\n", "", "median", "p99", "max");
+    printf("%12s %8.3fms %8.3fms %8.3fms\n", "incremental", percentile(incremental, 0.5), percentile(incremental, 0.99), percentile(incremental, 1));
+    printf("%12s %8.3fms %8.3fms %8.3fms\n", "full", percentile(full, 0.5), percentile(full, 0.99), percentile(full, 1));
+    printf("%.1f tokens lexed and %.1f statements parsed per edit\n", (double) tokens_lexed / count, (double) statements_parsed / count);
+    printf("%d edits left a program that doesn't parse, each was taken back with the next one\n", damaged);
+
+    return 0;
+}
+
+struct BaselineEntry {
+    uint64_t target;
+    int phase;
+    double mb_per_s;
+};
+
+std::vector<BaselineEntry> read_baseline(const char* path)
+{
+    std::vector<BaselineEntry> entries;
+    std::ifstream input(path);
+    std::string line;
+
+    while (std::getline(input, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        std::istringstream fields(line);
+        std::string size;
+        std::string phase;
+        double mb_per_s = 0;
+        fields >> size >> phase >> mb_per_s;
+
+        for (int i = 0; i < phase_count; i++) {
+            if (phase == phase_names[i]) {
+                entries.push_back({ parse_size(size.c_str()), i, mb_per_s });
+            }
+        }
+    }
+
+    return entries;
+}
+
+void write_baseline(const char* path, const std::vector<uint64_t>& targets, const std::vector<SizeResult>& results, const SynthOptions& options)
+{
+    std::ofstream output(path);
+
+    output << "# ion-bench baseline, seed " << options.seed << "\n";
+    output << "# the numbers are from the machine that recorded them, record them again\n";
+    output << "# with make bench-baseline after moving to another one\n";
+    output << "# size phase MB/s\n";
+
+    for (size_t i = 0; i < results.size(); i++) {
+        for (int phase = 0; phase < phase_count; phase++) {
+            output << format_size(targets[i]) << " " << phase_names[phase] << " " << throughput(results[i].bytes, results[i].milliseconds[phase]) << "\n";
+        }
+    }
+}
+
+void print_usage()
+{
+    printf("usage: ion-bench [options]\n");
+    printf("  --min SIZE          smallest program (default 1K)\n");
+    printf("  --max SIZE          largest program (default 100M)\n");
+    printf("  --seed N            generator seed (default 1)\n");
+    printf("  --repeat N          runs per size, fastest is kept (default 3)\n");
+    printf("  --baseline FILE     compare against FILE, failing if it's missing\n");
+    printf("  --update-baseline   record this run as the baseline in FILE\n");
+    printf("  --tolerance F       allowed slowdown before failing (default 0.25)\n");
+    printf("  --emit SIZE         print a generated program and exit\n");
+    printf("  --edits N           time N incremental edits of a --max sized program\n");
+}
+
+int main(int argc, char** argv)
+{
+    uint64_t min_size = 1024;
+    uint64_t max_size = 100ULL * 1024 * 1024;
+    int repeat = 3;
+    double tolerance = 0.25;
+    const char* baseline_path = nullptr;
+    bool update_baseline = false;
+    int edits = 0;
+    SynthOptions options;
+
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+
+        if (strcmp(argv[i], "--min") == 0 && has_value) {
+            min_size = parse_size(argv[++i]);
+        } else if (strcmp(argv[i], "--max") == 0 && has_value) {
+            max_size = parse_size(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && has_value) {
+            options.seed = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--repeat") == 0 && has_value) {
+            repeat = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--baseline") == 0 && has_value) {
+            baseline_path = argv[++i];
+        } else if (strcmp(argv[i], "--update-baseline") == 0) {
+            update_baseline = true;
+        } else if (strcmp(argv[i], "--tolerance") == 0 && has_value) {
+            tolerance = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--edits") == 0 && has_value) {
+            edits = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--emit") == 0 && has_value) {
+            std::string program = synthesize_program(parse_size(argv[++i]), options);
+            fwrite(program.data(), 1, program.size(), stdout);
+            return 0;
+        } else {
+            print_usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (repeat < 1) {
+        repeat = 1;
+    }
+
+    if (edits > 0) {
+        return run_edits(max_size, options, edits);
+    }
+
+    const uint64_t ladder[] = {
+        1ULL << 10, 10ULL << 10, 100ULL << 10,
+        1ULL << 20, 10ULL << 20, 100ULL << 20,
+        1ULL << 30,
+    };
+
+    std::vector<uint64_t> targets;
+    for (uint64_t size : ladder) {
+        if (size >= min_size && size <= max_size) {
+            targets.push_back(size);
+        }
+    }
+
+    printf("%8s %10s %10s", "size", "tokens", "nodes");
+    for (int phase = 0; phase < phase_count; phase++) {
+        printf(" %10s %9s %6s", phase_names[phase], "MB/s", "scale");
+    }
+    printf("\n");
+
+    std::vector<SizeResult> results;
+
+    for (size_t i = 0; i < targets.size(); i++) {
+        SizeResult result = run_size(targets[i], options, repeat);
+        results.push_back(result);
+
+        printf("%8s %10llu %10llu", format_size(targets[i]).c_str(), (unsigned long long) result.tokens, (unsigned long long) result.nodes);
+
+        for (int phase = 0; phase < phase_count; phase++) {
+            double milliseconds = result.milliseconds[phase];
+
+            // slope of time against input size on a log-log scale, 1.00 is
+            // linear and anything noticeably above it is a scaling problem
+            char scale[16] = "-";
+            if (i > 0 && results[i - 1].milliseconds[phase] > 0 && milliseconds > 0) {
+                double slope = std::log(milliseconds / results[i - 1].milliseconds[phase]) / std::log((double) result.bytes / results[i - 1].bytes);
+                snprintf(scale, sizeof(scale), "%.2f", slope);
+            }
+
+            printf(" %8.2fms %9.2f %6s", milliseconds, throughput(result.bytes, milliseconds), scale);
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+
+    if (baseline_path == nullptr) {
+        return 0;
+    }
+
+    std::vector<BaselineEntry> baseline = read_baseline(baseline_path);
+
+    if (update_baseline) {
+        write_baseline(baseline_path, targets, results, options);
+        printf("\nRecorded baseline in %s.\n", baseline_path);
+        return 0;
+    }
+
+    // a run that only records would pass whatever it measured
+    if (baseline.empty()) {
+        printf("\nNo baseline in %s, record one with --update-baseline.\n", baseline_path);
+        return EXIT_FAILURE;
+    }
+
+    int regressions = 0;
+
+    printf("\n");
+    for (const auto& entry : baseline) {
+        for (size_t i = 0; i < targets.size(); i++) {
+            if (targets[i] != entry.target) {
+                continue;
+            }
+
+            double current = throughput(results[i].bytes, results[i].milliseconds[entry.phase]);
+            double change = entry.mb_per_s > 0 ? current / entry.mb_per_s - 1 : 0;
+
+            if (change < -tolerance) {
+                printf("\x1b[31m[regression]\033[0m %s %s: %.2f MB/s, baseline %.2f MB/s (%+.0f%%)\n", format_size(entry.target).c_str(), phase_names[entry.phase], current, entry.mb_per_s, change * 100);
+                regressions++;
+            }
+        }
+    }
+
+    if (regressions > 0) {
+        return EXIT_FAILURE;
+    }
+
+    printf("No regressions against %s.\n", baseline_path);
+    return 0;
+}
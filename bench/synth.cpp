@@ -0,0 +1,136 @@
+#include "synth.hpp"
+
+const int variable_count = 8;
+
+const char* binary_operators[] = { "+", "-", "*", "/" };
+const char* condition_operators[] = { "==", "!=", "<", ">", "<=", ">=" };
+
+const char* asm_lines[] = {
+    "mov x0, #1",
+    "mov x1, #2",
+    "add x0, x0, x1",
+    "sub x1, x1, x0",
+    "str x0, [sp, -16]!",
+    "ldr x0, [sp], 16",
+    "mov x16, #1",
+};
+
+void synthesize_operand(Random& random, std::string& out)
+{
+    if (random.below(2) == 0) {
+        out += "v";
+        out += std::to_string(random.below(variable_count));
+    } else {
+        // never zero, so the divisions stay meaningful
+        out += std::to_string(1 + random.below(999));
+    }
+}
+
+void synthesize_expression(Random& random, int terms, std::string& out)
+{
+    synthesize_operand(random, out);
+
+    for (int i = 1; i < terms; i++) {
+        out += " ";
+        out += binary_operators[random.below(4)];
+        out += " ";
+
+        if (random.below(4) == 0) {
+            out += "(";
+            synthesize_operand(random, out);
+            out += " + ";
+            synthesize_operand(random, out);
+            out += ")";
+        } else {
+            synthesize_operand(random, out);
+        }
+    }
+}
+
+void synthesize_indent(int depth, std::string& out)
+{
+    out.append(depth * 4, ' ');
+}
+
+void synthesize_assignment(Random& random, int depth, int terms, std::string& out)
+{
+    synthesize_indent(depth, out);
+    out += "v";
+    out += std::to_string(random.below(variable_count));
+    out += " = ";
+    synthesize_expression(random, terms, out);
+    out += "\n";
+}
+
+void synthesize_if(Random& random, int depth, int remaining_depth, const SynthOptions& options, std::string& out)
+{
+    synthesize_indent(depth, out);
+    out += "if (";
+    synthesize_expression(random, 1 + random.below(3), out);
+    out += " ";
+    out += condition_operators[random.below(6)];
+    out += " ";
+    // the parser only takes a single term on the right of a comparison
+    synthesize_operand(random, out);
+    out += ") {\n";
+
+    synthesize_assignment(random, depth + 1, 1 + random.below(4), out);
+    if (remaining_depth > 1) {
+        synthesize_if(random, depth + 1, remaining_depth - 1, options, out);
+    }
+
+    synthesize_indent(depth, out);
+    out += "} else {\n";
+    synthesize_assignment(random, depth + 1, 1 + random.below(4), out);
+    synthesize_indent(depth, out);
+    out += "}\n";
+}
+
+void synthesize_asm(Random& random, int lines, std::string& out)
+{
+    out += "#asm {\n";
+
+    for (int i = 0; i < lines; i++) {
+        out += "    \"";
+        out += asm_lines[random.below(sizeof(asm_lines) / sizeof(asm_lines[0]))];
+        out += "\"\n";
+    }
+
+    out += "}\n";
+}
+
+std::string synthesize_program(uint64_t target_bytes, const SynthOptions& options)
+{
+    Random random = { options.seed };
+    std::string out;
+    out.reserve(target_bytes + 4096);
+
+    out += "// generated by ion-bench, seed ";
+    out += std::to_string(options.seed);
+    out += "\n";
+
+    // declare everything up front so every later reference resolves
+    for (int i = 0; i < variable_count; i++) {
+        out += "v";
+        out += std::to_string(i);
+        out += " = ";
+        out += std::to_string(i + 1);
+        out += "\n";
+    }
+
+    while (out.size() < target_bytes) {
+        int kind = random.below(10);
+
+        if (kind < 5) {
+            synthesize_assignment(random, 0, 1 + random.below(6), out);
+        } else if (kind < 7) {
+            synthesize_if(random, 0, 1 + random.below(options.max_if_depth), options, out);
+        } else if (kind < 9) {
+            synthesize_assignment(random, 0, options.max_expression_terms / 2 + random.below(options.max_expression_terms / 2), out);
+        } else {
+            synthesize_asm(random, 1 + random.below(options.max_asm_lines), out);
+        }
+    }
+
+    return out;
+}
@@ -0,0 +1,39 @@
+#ifndef SYNTH_HPP
+#define SYNTH_HPP
+
+#include <cstdint>
+#include <string>
+
+// splitmix64, so a seed produces the same program everywhere (the standard
+// distributions are allowed to differ between library implementations)
+struct Random {
+    uint64_t state;
+
+    uint64_t next()
+    {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    int below(int bound)
+    {
+        return (int) (next() % (uint64_t) bound);
+    }
+};
+
+struct SynthOptions {
+    uint64_t seed = 1;
+
+    // how deep if/else chains nest and how many terms a long expression has
+    int max_if_depth = 12;
+    int max_expression_terms = 64;
+    int max_asm_lines = 48;
+};
+
+// produces a valid ion program of at least target_bytes, identical for the
+// same seed and options on every platform
+std::string synthesize_program(uint64_t target_bytes, const SynthOptions& options);
+
+#endif
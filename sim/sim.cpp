@@ -0,0 +1,1224 @@
+// ion-sim runs the ARM64 subset that the ion backend emits, so generated code
+// can be checked and measured on machines that can't execute it natively.
+
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <unistd.h>
+
+enum Opcode : uint8_t {
+    OP_MOV,
+    OP_MOVZ,
+    OP_MOVN,
+    OP_MOVK,
+    OP_ADRP,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_SMULH,
+    OP_SDIV,
+    OP_NEG,
+    OP_LSL,
+    OP_LSR,
+    OP_ASR,
+    OP_STR,
+    OP_LDR,
+    OP_STP,
+    OP_LDP,
+    OP_CMP,
+    OP_B,
+    OP_BCOND,
+    OP_CBZ,
+    OP_CBNZ,
+    OP_BL,
+    OP_RET,
+    OP_SVC,
+};
+
+enum Condition : uint8_t {
+    COND_EQ,
+    COND_NE,
+    COND_HS,
+    COND_LO,
+    COND_MI,
+    COND_PL,
+    COND_VS,
+    COND_VC,
+    COND_HI,
+    COND_LS,
+    COND_GE,
+    COND_LT,
+    COND_GT,
+    COND_LE,
+    COND_AL,
+};
+
+enum AddressMode : uint8_t {
+    ADDRESS_OFFSET,     // [xn, #imm]
+    ADDRESS_PRE_INDEX,  // [xn, #imm]!
+    ADDRESS_POST_INDEX, // [xn], #imm
+};
+
+// which part of a symbol's address an operand like '_lit0@PAGEOFF' asks for
+enum SymbolPart : uint8_t {
+    SYMBOL_NONE,
+    SYMBOL_PAGE,
+    SYMBOL_PAGEOFF,
+};
+
+enum ShiftType : uint8_t {
+    SHIFT_LSL,
+    SHIFT_LSR,
+    SHIFT_ASR,
+};
+
+// x0-x30 live at their own index, sp and xzr get the two after that so the
+// two meanings of register 31 never have to be told apart at run time
+const int REGISTER_SP = 31;
+const int REGISTER_ZR = 32;
+
+struct Instruction {
+    Opcode op;
+    Condition condition;
+    AddressMode mode;
+
+    int rd = -1;
+    int rn = -1;
+    int rm = -1;
+
+    bool has_immediate = false;
+    int64_t immediate = 0;
+    int shift = 0;
+    ShiftType shift_type = SHIFT_LSL;
+
+    // data symbol the immediate is taken from, filled in after loading
+    std::string symbol;
+    SymbolPart symbol_part = SYMBOL_NONE;
+
+    // instruction index for branches, resolved once every label is known
+    std::string label;
+    int target = -1;
+
+    int line;
+};
+
+struct Program {
+    std::vector<Instruction> instructions;
+    std::unordered_map<std::string, int> labels;
+
+    // everything outside the text section, loaded at data_base
+    std::vector<uint8_t> data;
+    std::unordered_map<std::string, uint64_t> data_labels;
+    uint64_t data_base = 0x400000;
+};
+
+struct Counters {
+    uint64_t instructions = 0;
+    uint64_t loads = 0;
+    uint64_t stores = 0;
+    uint64_t branches = 0;
+    uint64_t taken_branches = 0;
+};
+
+[[noreturn]] void fail(int line, const char* message, const std::string& detail)
+{
+    fprintf(stderr, "ion-sim: %s '%s' (line %d)\n", message, detail.c_str(), line);
+    exit(2);
+}
+
+std::string trim(const std::string& text)
+{
+    size_t start = 0;
+    size_t end = text.size();
+
+    while (start < end && std::isspace((unsigned char) text[start]) != 0) {
+        start++;
+    }
+    while (end > start && std::isspace((unsigned char) text[end - 1]) != 0) {
+        end--;
+    }
+
+    return text.substr(start, end - start);
+}
+
+std::string lowercase(std::string text)
+{
+    for (auto& c : text) {
+        c = (char) std::tolower((unsigned char) c);
+    }
+
+    return text;
+}
+
+// splits on commas that aren't inside a memory operand
+std::vector<std::string> split_operands(const std::string& text)
+{
+    std::vector<std::string> operands;
+    std::string current;
+    int depth = 0;
+
+    for (char c : text) {
+        if (c == '[') {
+            depth++;
+        } else if (c == ']') {
+            depth--;
+        }
+
+        if (c == ',' && depth == 0) {
+            operands.push_back(trim(current));
+            current.clear();
+            continue;
+        }
+
+        current.push_back(c);
+    }
+
+    if (!trim(current).empty()) {
+        operands.push_back(trim(current));
+    }
+
+    return operands;
+}
+
+int parse_register(const std::string& text, int line)
+{
+    std::string name = lowercase(trim(text));
+
+    if (name == "sp") {
+        return REGISTER_SP;
+    }
+    if (name == "xzr") {
+        return REGISTER_ZR;
+    }
+    if (name == "fp") {
+        return 29;
+    }
+    if (name == "lr") {
+        return 30;
+    }
+
+    if (name.size() >= 2 && name[0] == 'x') {
+        char* end = nullptr;
+        long index = strtol(name.c_str() + 1, &end, 10);
+
+        if (*end == '\0' && index >= 0 && index <= 30) {
+            return (int) index;
+        }
+    }
+
+    fail(line, "unknown register", text);
+}
+
+bool is_immediate(const std::string& text)
+{
+    std::string value = trim(text);
+
+    if (!value.empty() && value[0] == '#') {
+        return true;
+    }
+
+    return !value.empty() && (std::isdigit((unsigned char) value[0]) != 0 || value[0] == '-');
+}
+
+int64_t parse_immediate(const std::string& text, int line)
+{
+    std::string value = trim(text);
+
+    if (!value.empty() && value[0] == '#') {
+        value = value.substr(1);
+    }
+
+    char* end = nullptr;
+    int64_t result = strtoll(value.c_str(), &end, 0);
+
+    if (value.empty() || *end != '\0') {
+        fail(line, "bad immediate", text);
+    }
+
+    return result;
+}
+
+// reads '#imm' or 'symbol@PAGE' style operands into the instruction
+void parse_immediate_operand(Instruction& instruction, const std::string& text, int line)
+{
+    std::string value = trim(text);
+    size_t at = value.find('@');
+
+    if (at == std::string::npos) {
+        instruction.immediate = parse_immediate(value, line);
+        return;
+    }
+
+    std::string part = lowercase(value.substr(at + 1));
+    if (part == "page") {
+        instruction.symbol_part = SYMBOL_PAGE;
+    } else if (part == "pageoff") {
+        instruction.symbol_part = SYMBOL_PAGEOFF;
+    } else {
+        fail(line, "unsupported relocation", value);
+    }
+
+    instruction.symbol = value.substr(0, at);
+}
+
+// 'lsl #n' as the last operand of the wide moves and add/sub immediates
+int parse_shift(const std::vector<std::string>& operands, size_t index, int line)
+{
+    if (operands.size() <= index) {
+        return 0;
+    }
+
+    std::string shift = lowercase(operands[index]);
+    if (shift.compare(0, 3, "lsl") != 0) {
+        fail(line, "expected lsl", operands[index]);
+    }
+
+    return (int) parse_immediate(shift.substr(3), line);
+}
+
+// 'lsl #n', 'lsr #n' or 'asr #n' applied to the last register of add/sub
+void parse_register_shift(Instruction& instruction, const std::string& text, int line)
+{
+    std::string shift = lowercase(trim(text));
+
+    if (shift.compare(0, 3, "lsl") == 0) {
+        instruction.shift_type = SHIFT_LSL;
+    } else if (shift.compare(0, 3, "lsr") == 0) {
+        instruction.shift_type = SHIFT_LSR;
+    } else if (shift.compare(0, 3, "asr") == 0) {
+        instruction.shift_type = SHIFT_ASR;
+    } else {
+        fail(line, "expected lsl, lsr or asr", text);
+    }
+
+    instruction.shift = (int) parse_immediate(trim(shift.substr(3)), line);
+    if (instruction.shift < 0 || instruction.shift > 63) {
+        fail(line, "shift amount out of range", text);
+    }
+}
+
+int64_t apply_shift(int64_t value, ShiftType type, int amount)
+{
+    switch (type) {
+        case SHIFT_LSL: return (int64_t) ((uint64_t) value << amount);
+        case SHIFT_LSR: return (int64_t) ((uint64_t) value >> amount);
+        case SHIFT_ASR: return value >> amount;
+    }
+
+    return value;
+}
+
+bool is_shifted_mask(uint64_t value)
+{
+    uint64_t filled = (value - 1) | value;
+    return value != 0 && ((filled + 1) & filled) == 0;
+}
+
+bool is_bitmask_immediate(uint64_t value)
+{
+    if (value == 0 || value == ~0ULL) {
+        return false;
+    }
+
+    int size = 64;
+    do {
+        size /= 2;
+        uint64_t mask = (1ULL << size) - 1;
+
+        if ((value & mask) != ((value >> size) & mask)) {
+            size *= 2;
+            break;
+        }
+    } while (size > 2);
+
+    uint64_t mask = size == 64 ? ~0ULL : (1ULL << size) - 1;
+    uint64_t element = value & mask;
+
+    return is_shifted_mask(element) || is_shifted_mask(~(element | ~mask));
+}
+
+// the 'mov' alias only exists for values a single movz, movn or orr can build,
+// anything else is rejected by the real assembler and so is rejected here
+bool is_mov_immediate(int64_t value)
+{
+    uint64_t bits = (uint64_t) value;
+
+    for (int shift = 0; shift < 64; shift += 16) {
+        uint64_t halfword = 0xffffULL << shift;
+
+        if ((bits & ~halfword) == 0 || (~bits & ~halfword) == 0) {
+            return true;
+        }
+    }
+
+    return is_bitmask_immediate(bits);
+}
+
+Condition parse_condition(const std::string& text, int line)
+{
+    static const char* names[] = { "eq", "ne", "hs", "lo", "mi", "pl", "vs", "vc", "hi", "ls", "ge", "lt", "gt", "le", "al" };
+
+    std::string name = lowercase(text);
+    if (name == "cs") {
+        return COND_HS;
+    }
+    if (name == "cc") {
+        return COND_LO;
+    }
+
+    for (int i = 0; i <= COND_AL; i++) {
+        if (name == names[i]) {
+            return (Condition) i;
+        }
+    }
+
+    fail(line, "unknown condition", text);
+}
+
+void parse_memory_operand(Instruction& instruction, const std::vector<std::string>& operands, int line)
+{
+    if (operands.size() < 2) {
+        fail(line, "expected a memory operand", "");
+    }
+
+    instruction.rd = parse_register(operands[0], line);
+
+    std::string memory = operands[1];
+    size_t open = memory.find('[');
+    size_t close = memory.find(']');
+
+    if (open == std::string::npos || close == std::string::npos) {
+        fail(line, "bad memory operand", memory);
+    }
+
+    std::vector<std::string> inner = split_operands(memory.substr(open + 1, close - open - 1));
+    instruction.rn = parse_register(inner[0], line);
+    instruction.mode = ADDRESS_OFFSET;
+
+    if (inner.size() > 1) {
+        parse_immediate_operand(instruction, inner[1], line);
+    }
+
+    if (memory.find('!', close) != std::string::npos) {
+        instruction.mode = ADDRESS_PRE_INDEX;
+    } else if (operands.size() > 2) {
+        instruction.mode = ADDRESS_POST_INDEX;
+        instruction.immediate = parse_immediate(operands[2], line);
+    }
+}
+
+Instruction parse_instruction(const std::string& text, int line)
+{
+    Instruction instruction;
+    instruction.line = line;
+    instruction.condition = COND_AL;
+    instruction.mode = ADDRESS_OFFSET;
+
+    size_t space = text.find_first_of(" \t");
+    std::string mnemonic = lowercase(text.substr(0, space));
+    std::vector<std::string> operands = split_operands(space == std::string::npos ? "" : text.substr(space + 1));
+
+    if (mnemonic.compare(0, 2, "b.") == 0) {
+        instruction.op = OP_BCOND;
+        instruction.condition = parse_condition(mnemonic.substr(2), line);
+        instruction.label = operands.at(0);
+        return instruction;
+    }
+
+    if (mnemonic == "cbz" || mnemonic == "cbnz") {
+        instruction.op = mnemonic == "cbz" ? OP_CBZ : OP_CBNZ;
+        if (operands.size() != 2) {
+            fail(line, "expected a register and a label", text);
+        }
+
+        instruction.rn = parse_register(operands[0], line);
+        instruction.label = operands[1];
+        return instruction;
+    }
+
+    if (mnemonic == "b" || mnemonic == "bl") {
+        instruction.op = mnemonic == "b" ? OP_B : OP_BL;
+        instruction.label = operands.at(0);
+        return instruction;
+    }
+
+    if (mnemonic == "ret") {
+        instruction.op = OP_RET;
+        instruction.rn = operands.empty() ? 30 : parse_register(operands[0], line);
+        return instruction;
+    }
+
+    if (mnemonic == "svc") {
+        instruction.op = OP_SVC;
+        return instruction;
+    }
+
+    if (mnemonic == "str" || mnemonic == "ldr") {
+        instruction.op = mnemonic == "str" ? OP_STR : OP_LDR;
+        parse_memory_operand(instruction, operands, line);
+        return instruction;
+    }
+
+    if (mnemonic == "stp" || mnemonic == "ldp") {
+        instruction.op = mnemonic == "stp" ? OP_STP : OP_LDP;
+        if (operands.size() < 3) {
+            fail(line, "expected two registers and a memory operand", text);
+        }
+
+        // the second register goes in rm, the rest reads like str/ldr
+        std::vector<std::string> rest(operands.begin() + 1, operands.end());
+        parse_memory_operand(instruction, rest, line);
+        instruction.rm = instruction.rd;
+        instruction.rd = parse_register(operands[0], line);
+        return instruction;
+    }
+
+    if (mnemonic == "mov") {
+        instruction.op = OP_MOV;
+        if (operands.size() != 2) {
+            fail(line, "mov takes two operands", text);
+        }
+
+        instruction.rd = parse_register(operands[0], line);
+        if (is_immediate(operands[1])) {
+            instruction.has_immediate = true;
+            instruction.immediate = parse_immediate(operands[1], line);
+
+            if (!is_mov_immediate(instruction.immediate)) {
+                fail(line, "immediate can't be encoded by mov", text);
+            }
+        } else {
+            instruction.rn = parse_register(operands[1], line);
+        }
+
+        return instruction;
+    }
+
+    if (mnemonic == "movz" || mnemonic == "movn" || mnemonic == "movk") {
+        if (mnemonic == "movz") {
+            instruction.op = OP_MOVZ;
+        } else if (mnemonic == "movn") {
+            instruction.op = OP_MOVN;
+        } else {
+            instruction.op = OP_MOVK;
+        }
+
+        if (operands.size() < 2) {
+            fail(line, "expected a register and an immediate", text);
+        }
+
+        instruction.rd = parse_register(operands[0], line);
+        instruction.immediate = parse_immediate(operands[1], line);
+        instruction.shift = parse_shift(operands, 2, line);
+
+        if (instruction.immediate < 0 || instruction.immediate > 0xffff || instruction.shift % 16 != 0 || instruction.shift > 48) {
+            fail(line, "wide move immediate out of range", text);
+        }
+
+        return instruction;
+    }
+
+    if (mnemonic == "adrp") {
+        instruction.op = OP_ADRP;
+        if (operands.size() != 2) {
+            fail(line, "adrp takes two operands", text);
+        }
+
+        instruction.rd = parse_register(operands[0], line);
+        parse_immediate_operand(instruction, operands[1], line);
+
+        if (instruction.symbol_part != SYMBOL_PAGE) {
+            fail(line, "adrp expects a symbol@PAGE operand", text);
+        }
+
+        return instruction;
+    }
+
+    if (mnemonic == "cmp") {
+        instruction.op = OP_CMP;
+        if (operands.size() != 2) {
+            fail(line, "cmp takes two operands", text);
+        }
+
+        instruction.rn = parse_register(operands[0], line);
+        if (is_immediate(operands[1])) {
+            instruction.has_immediate = true;
+            instruction.immediate = parse_immediate(operands[1], line);
+        } else {
+            instruction.rm = parse_register(operands[1], line);
+        }
+
+        return instruction;
+    }
+
+    if (mnemonic == "neg") {
+        instruction.op = OP_NEG;
+        if (operands.size() != 2) {
+            fail(line, "neg takes two operands", text);
+        }
+
+        instruction.rd = parse_register(operands[0], line);
+        instruction.rm = parse_register(operands[1], line);
+        return instruction;
+    }
+
+    if (mnemonic == "lsl" || mnemonic == "lsr" || mnemonic == "asr") {
+        if (mnemonic == "lsl") {
+            instruction.op = OP_LSL;
+        } else if (mnemonic == "lsr") {
+            instruction.op = OP_LSR;
+        } else {
+            instruction.op = OP_ASR;
+        }
+
+        if (operands.size() != 3 || !is_immediate(operands[2])) {
+            fail(line, "expected two registers and a shift amount", text);
+        }
+
+        instruction.rd = parse_register(operands[0], line);
+        instruction.rn = parse_register(operands[1], line);
+        instruction.immediate = parse_immediate(operands[2], line);
+
+        if (instruction.immediate < 0 || instruction.immediate > 63) {
+            fail(line, "shift amount out of range", text);
+        }
+        return instruction;
+    }
+
+    if (mnemonic == "add" || mnemonic == "sub" || mnemonic == "mul" || mnemonic == "smulh" || mnemonic == "sdiv") {
+        if (mnemonic == "add") {
+            instruction.op = OP_ADD;
+        } else if (mnemonic == "sub") {
+            instruction.op = OP_SUB;
+        } else if (mnemonic == "mul") {
+            instruction.op = OP_MUL;
+        } else if (mnemonic == "smulh") {
+            instruction.op = OP_SMULH;
+        } else {
+            instruction.op = OP_SDIV;
+        }
+
+        bool takes_immediate = instruction.op == OP_ADD || instruction.op == OP_SUB;
+
+        if (operands.size() != 3 && !(takes_immediate && operands.size() == 4)) {
+            fail(line, "expected three operands", text);
+        }
+
+        instruction.rd = parse_register(operands[0], line);
+        instruction.rn = parse_register(operands[1], line);
+
+        if (takes_immediate && (is_immediate(operands[2]) || operands[2].find('@') != std::string::npos)) {
+            instruction.has_immediate = true;
+            parse_immediate_operand(instruction, operands[2], line);
+
+            // 12 bit immediate, optionally shifted into the upper half
+            instruction.shift = parse_shift(operands, 3, line);
+            if (instruction.shift != 0 && instruction.shift != 12) {
+                fail(line, "add/sub immediates can only be shifted by 12", text);
+            }
+            if (instruction.symbol_part == SYMBOL_NONE && (instruction.immediate < 0 || instruction.immediate > 4095)) {
+                fail(line, "add/sub immediate out of range", text);
+            }
+            instruction.immediate <<= instruction.shift;
+        } else {
+            instruction.rm = parse_register(operands[2], line);
+
+            if (operands.size() == 4) {
+                parse_register_shift(instruction, operands[3], line);
+            }
+        }
+
+        return instruction;
+    }
+
+    fail(line, "unsupported instruction", text);
+}
+
+std::string strip_comment(const std::string& text)
+{
+    bool quoted = false;
+
+    for (size_t i = 0; i < text.size(); i++) {
+        if (text[i] == '"' && (i == 0 || text[i - 1] != '\\')) {
+            quoted = !quoted;
+        } else if (!quoted && text.compare(i, 2, "//") == 0) {
+            return text.substr(0, i);
+        }
+    }
+
+    return text;
+}
+
+// the inside of an .asciz string, with the escapes the backend writes
+void append_string(std::vector<uint8_t>& data, const std::string& argument, int line)
+{
+    if (argument.size() < 2 || argument.front() != '"' || argument.back() != '"') {
+        fail(line, "expected a quoted string", argument);
+    }
+
+    for (size_t i = 1; i + 1 < argument.size(); i++) {
+        char c = argument[i];
+
+        if (c != '\\') {
+            data.push_back((uint8_t) c);
+            continue;
+        }
+
+        c = argument[++i];
+        if (c >= '0' && c <= '7') {
+            int value = 0;
+            for (int digits = 0; digits < 3 && argument[i] >= '0' && argument[i] <= '7'; digits++) {
+                value = value * 8 + (argument[i++] - '0');
+            }
+            i--;
+            data.push_back((uint8_t) value);
+        } else if (c == 'n') {
+            data.push_back('\n');
+        } else if (c == 't') {
+            data.push_back('\t');
+        } else {
+            data.push_back((uint8_t) c);
+        }
+    }
+
+    data.push_back(0);
+}
+
+// section switches and the data directives the backend uses, everything
+// else (.global and friends) doesn't affect execution
+void load_directive(Program& program, const std::string& text, bool& in_text, int line)
+{
+    size_t space = text.find_first_of(" \t");
+    std::string directive = lowercase(text.substr(0, space));
+    std::string argument = space == std::string::npos ? "" : trim(text.substr(space + 1));
+
+    if (directive == ".text") {
+        in_text = true;
+    } else if (directive == ".data" || directive == ".const") {
+        in_text = false;
+    } else if (directive == ".section") {
+        in_text = lowercase(argument) == "__text,__text";
+    } else if (directive == ".p2align" && !in_text) {
+        size_t alignment = 1ULL << parse_immediate(argument, line);
+
+        while (program.data.size() % alignment != 0) {
+            program.data.push_back(0);
+        }
+    } else if (directive == ".quad") {
+        if (in_text) {
+            fail(line, "data in the text section", text);
+        }
+
+        int64_t value = parse_immediate(argument, line);
+        uint8_t bytes[8];
+        memcpy(bytes, &value, sizeof(bytes));
+        program.data.insert(program.data.end(), bytes, bytes + sizeof(bytes));
+    } else if (directive == ".asciz") {
+        if (in_text) {
+            fail(line, "data in the text section", text);
+        }
+
+        append_string(program.data, argument, line);
+    } else if (directive == ".zerofill") {
+        // segment, section, symbol, size and log2 alignment. zeros are
+        // simply appended to the data, wherever it is
+        std::vector<std::string> fields = split_operands(argument);
+        if (fields.size() < 4) {
+            fail(line, "expected segment, section, symbol and size", text);
+        }
+
+        size_t alignment = fields.size() > 4 ? 1ULL << parse_immediate(fields[4], line) : 1;
+        while (program.data.size() % alignment != 0) {
+            program.data.push_back(0);
+        }
+
+        program.data_labels[fields[2]] = program.data_base + program.data.size();
+        program.data.resize(program.data.size() + parse_immediate(fields[3], line), 0);
+    }
+}
+
+Program load_program(const char* path)
+{
+    std::ifstream input(path);
+    if (!input.is_open()) {
+        fprintf(stderr, "ion-sim: could not open %s\n", path);
+        exit(2);
+    }
+
+    Program program;
+    std::string raw_line;
+    int line = 0;
+    bool in_text = true;
+
+    while (std::getline(input, raw_line)) {
+        line++;
+
+        std::string text = trim(strip_comment(raw_line));
+
+        // a line can carry a label and an instruction, e.g. "_if0: mov x0, #1"
+        size_t colon = text.find(':');
+        if (colon != std::string::npos && text.find('"') == std::string::npos) {
+            std::string label = trim(text.substr(0, colon));
+
+            if (in_text) {
+                program.labels[label] = (int) program.instructions.size();
+            } else {
+                program.data_labels[label] = program.data_base + program.data.size();
+            }
+
+            text = trim(text.substr(colon + 1));
+        }
+
+        if (text.empty()) {
+            continue;
+        }
+
+        if (text[0] == '.') {
+            load_directive(program, text, in_text, line);
+            continue;
+        }
+
+        if (!in_text) {
+            fail(line, "instruction outside the text section", text);
+        }
+
+        program.instructions.push_back(parse_instruction(text, line));
+    }
+
+    for (auto& instruction : program.instructions) {
+        if (instruction.symbol_part != SYMBOL_NONE) {
+            auto symbol = program.data_labels.find(instruction.symbol);
+            if (symbol == program.data_labels.end()) {
+                fail(instruction.line, "unknown data symbol", instruction.symbol);
+            }
+
+            instruction.immediate = instruction.symbol_part == SYMBOL_PAGE ? symbol->second & ~0xfffULL : symbol->second & 0xfff;
+        }
+
+        if (instruction.label.empty()) {
+            continue;
+        }
+
+        auto label = program.labels.find(instruction.label);
+        if (label == program.labels.end()) {
+            fail(instruction.line, "unknown label", instruction.label);
+        }
+
+        instruction.target = label->second;
+    }
+
+    return program;
+}
+
+struct Machine {
+    int64_t registers[33] = {};
+
+    bool n = false;
+    bool z = false;
+    bool c = false;
+    bool v = false;
+
+    // the stack grows down from stack_top, the program's data sits at
+    // data_base and everything else is unmapped
+    uint64_t stack_top = 0x100000000ULL;
+    std::vector<uint8_t> stack = std::vector<uint8_t>(1 << 20);
+
+    uint64_t data_base = 0;
+    std::vector<uint8_t> data;
+
+    // instruction n pretends to live at text_base + 4n, which is what bl
+    // leaves in the link register
+    uint64_t text_base = 0x10000;
+
+    int64_t read(int index)
+    {
+        return index == REGISTER_ZR ? 0 : registers[index];
+    }
+
+    void write(int index, int64_t value)
+    {
+        if (index != REGISTER_ZR) {
+            registers[index] = value;
+        }
+    }
+
+    uint8_t* address(uint64_t at, uint64_t size, int line)
+    {
+        uint64_t stack_base = stack_top - stack.size();
+
+        if (at >= stack_base && at + size <= stack_top) {
+            return stack.data() + (at - stack_base);
+        }
+
+        if (at >= data_base && at + size <= data_base + data.size()) {
+            return data.data() + (at - data_base);
+        }
+
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "0x%llx", (unsigned long long) at);
+        fail(line, "memory access out of bounds", buffer);
+    }
+
+    // result is what the host call returned, -1 with errno set on failure
+    void return_from_system_call(int64_t result)
+    {
+        c = result < 0;
+        write(0, result < 0 ? errno : result);
+    }
+
+    void compare(int64_t left, int64_t right)
+    {
+        uint64_t result = (uint64_t) left - (uint64_t) right;
+
+        n = (int64_t) result < 0;
+        z = result == 0;
+        c = (uint64_t) left >= (uint64_t) right;
+        v = ((left < 0) != (right < 0)) && (((int64_t) result < 0) != (left < 0));
+    }
+
+    bool holds(Condition condition)
+    {
+        switch (condition) {
+            case COND_EQ: return z;
+            case COND_NE: return !z;
+            case COND_HS: return c;
+            case COND_LO: return !c;
+            case COND_MI: return n;
+            case COND_PL: return !n;
+            case COND_VS: return v;
+            case COND_VC: return !v;
+            case COND_HI: return c && !z;
+            case COND_LS: return !c || z;
+            case COND_GE: return n == v;
+            case COND_LT: return n != v;
+            case COND_GT: return !z && n == v;
+            case COND_LE: return z || n != v;
+            case COND_AL: return true;
+        }
+
+        return true;
+    }
+};
+
+int run(const Program& program, Machine& machine, Counters& counters, uint64_t max_steps)
+{
+    auto entry = program.labels.find("_main");
+    if (entry == program.labels.end()) {
+        fail(0, "missing entry point", "_main");
+    }
+
+    machine.registers[REGISTER_SP] = (int64_t) machine.stack_top;
+    machine.data_base = program.data_base;
+    machine.data = program.data;
+
+    size_t pc = entry->second;
+
+    while (true) {
+        if (pc >= program.instructions.size()) {
+            fail(0, "execution ran past the last instruction", "");
+        }
+
+        if (counters.instructions >= max_steps) {
+            fail(program.instructions[pc].line, "step limit reached", std::to_string(max_steps));
+        }
+
+        const Instruction& instruction = program.instructions[pc];
+        counters.instructions++;
+        pc++;
+
+        switch (instruction.op) {
+            case OP_MOV: {
+                machine.write(instruction.rd, instruction.has_immediate ? instruction.immediate : machine.read(instruction.rn));
+                break;
+            }
+            case OP_MOVZ: {
+                machine.write(instruction.rd, (int64_t) ((uint64_t) instruction.immediate << instruction.shift));
+                break;
+            }
+            case OP_MOVN: {
+                machine.write(instruction.rd, (int64_t) ~((uint64_t) instruction.immediate << instruction.shift));
+                break;
+            }
+            case OP_MOVK: {
+                uint64_t value = (uint64_t) machine.read(instruction.rd) & ~(0xffffULL << instruction.shift);
+                machine.write(instruction.rd, (int64_t) (value | ((uint64_t) instruction.immediate << instruction.shift)));
+                break;
+            }
+            case OP_ADRP: {
+                machine.write(instruction.rd, instruction.immediate);
+                break;
+            }
+            case OP_ADD:
+            case OP_SUB: {
+                uint64_t left = (uint64_t) machine.read(instruction.rn);
+                uint64_t right = (uint64_t) (instruction.has_immediate ? instruction.immediate : apply_shift(machine.read(instruction.rm), instruction.shift_type, instruction.shift));
+
+                machine.write(instruction.rd, (int64_t) (instruction.op == OP_ADD ? left + right : left - right));
+                break;
+            }
+            case OP_MUL: {
+                uint64_t product = (uint64_t) machine.read(instruction.rn) * (uint64_t) machine.read(instruction.rm);
+                machine.write(instruction.rd, (int64_t) product);
+                break;
+            }
+            case OP_SMULH: {
+                // high half of the 128 bit product, built from 32 bit halves
+                int64_t a = machine.read(instruction.rn);
+                int64_t b = machine.read(instruction.rm);
+
+                uint64_t a_low = (uint64_t) a & 0xffffffff;
+                uint64_t b_low = (uint64_t) b & 0xffffffff;
+                int64_t a_high = a >> 32;
+                int64_t b_high = b >> 32;
+
+                uint64_t low_low = a_low * b_low;
+                int64_t high_low = a_high * (int64_t) b_low + (int64_t) (low_low >> 32);
+                int64_t low_high = (int64_t) a_low * b_high + (int64_t) ((uint64_t) high_low & 0xffffffff);
+
+                machine.write(instruction.rd, a_high * b_high + (high_low >> 32) + (low_high >> 32));
+                break;
+            }
+            case OP_NEG: {
+                machine.write(instruction.rd, (int64_t) (0 - (uint64_t) machine.read(instruction.rm)));
+                break;
+            }
+            case OP_LSL:
+            case OP_LSR:
+            case OP_ASR: {
+                ShiftType type = instruction.op == OP_LSL ? SHIFT_LSL : (instruction.op == OP_LSR ? SHIFT_LSR : SHIFT_ASR);
+                machine.write(instruction.rd, apply_shift(machine.read(instruction.rn), type, (int) instruction.immediate));
+                break;
+            }
+            case OP_SDIV: {
+                int64_t dividend = machine.read(instruction.rn);
+                int64_t divisor = machine.read(instruction.rm);
+
+                // arm64 defines both of these instead of trapping
+                int64_t quotient = 0;
+                if (divisor == -1 && dividend == INT64_MIN) {
+                    quotient = INT64_MIN;
+                } else if (divisor != 0) {
+                    quotient = dividend / divisor;
+                }
+
+                machine.write(instruction.rd, quotient);
+                break;
+            }
+            case OP_STR:
+            case OP_LDR: {
+                int64_t base = machine.read(instruction.rn);
+                int64_t at = instruction.mode == ADDRESS_POST_INDEX ? base : base + instruction.immediate;
+                uint8_t* memory = machine.address((uint64_t) at, 8, instruction.line);
+
+                if (instruction.op == OP_STR) {
+                    int64_t value = machine.read(instruction.rd);
+                    memcpy(memory, &value, sizeof(value));
+                    counters.stores++;
+                } else {
+                    int64_t value = 0;
+                    memcpy(&value, memory, sizeof(value));
+                    machine.write(instruction.rd, value);
+                    counters.loads++;
+                }
+
+                if (instruction.mode != ADDRESS_OFFSET) {
+                    machine.write(instruction.rn, base + instruction.immediate);
+                }
+                break;
+            }
+            case OP_STP:
+            case OP_LDP: {
+                int64_t base = machine.read(instruction.rn);
+                int64_t at = instruction.mode == ADDRESS_POST_INDEX ? base : base + instruction.immediate;
+                uint8_t* memory = machine.address((uint64_t) at, 16, instruction.line);
+
+                if (instruction.op == OP_STP) {
+                    int64_t values[2] = { machine.read(instruction.rd), machine.read(instruction.rm) };
+                    memcpy(memory, values, sizeof(values));
+                    counters.stores += 2;
+                } else {
+                    int64_t values[2];
+                    memcpy(values, memory, sizeof(values));
+                    machine.write(instruction.rd, values[0]);
+                    machine.write(instruction.rm, values[1]);
+                    counters.loads += 2;
+                }
+
+                if (instruction.mode != ADDRESS_OFFSET) {
+                    machine.write(instruction.rn, base + instruction.immediate);
+                }
+                break;
+            }
+            case OP_CMP: {
+                int64_t right = instruction.has_immediate ? instruction.immediate : machine.read(instruction.rm);
+                machine.compare(machine.read(instruction.rn), right);
+                break;
+            }
+            case OP_B: {
+                counters.branches++;
+                counters.taken_branches++;
+                pc = instruction.target;
+                break;
+            }
+            case OP_BCOND: {
+                counters.branches++;
+                if (machine.holds(instruction.condition)) {
+                    counters.taken_branches++;
+                    pc = instruction.target;
+                }
+                break;
+            }
+            case OP_CBZ:
+            case OP_CBNZ: {
+                counters.branches++;
+                if ((machine.read(instruction.rn) == 0) == (instruction.op == OP_CBZ)) {
+                    counters.taken_branches++;
+                    pc = instruction.target;
+                }
+                break;
+            }
+            case OP_BL: {
+                counters.branches++;
+                counters.taken_branches++;
+                machine.write(30, (int64_t) (machine.text_base + 4 * pc));
+                pc = instruction.target;
+                break;
+            }
+            case OP_RET: {
+                counters.branches++;
+                counters.taken_branches++;
+
+                uint64_t target = (uint64_t) machine.read(instruction.rn);
+                if (target < machine.text_base || (target - machine.text_base) % 4 != 0) {
+                    fail(instruction.line, "return to a bad address", std::to_string(target));
+                }
+
+                pc = (target - machine.text_base) / 4;
+                break;
+            }
+            case OP_SVC: {
+                int64_t call = machine.read(16);
+
+                if (call == 1) {
+                    return (int) (machine.read(0) & 0xff);
+                }
+
+                // write, open and close go to the host, e.g. for the
+                // profile an instrumented build writes on exit. like the
+                // kernel, a failure sets the carry flag and leaves errno in x0
+                if (call == 4) {
+                    uint64_t length = machine.read(2);
+                    const uint8_t* bytes = length == 0 ? nullptr : machine.address(machine.read(1), length, instruction.line);
+                    machine.return_from_system_call(length == 0 ? 0 : (int64_t) ::write((int) machine.read(0), bytes, length));
+                    break;
+                }
+
+                if (call == 5) {
+                    std::string path;
+                    for (uint64_t at = machine.read(0); *machine.address(at, 1, instruction.line) != 0; at++) {
+                        path.push_back((char) *machine.address(at, 1, instruction.line));
+                    }
+
+                    // macOS's flag values
+                    int64_t flags = machine.read(1);
+                    int host_flags = (flags & 3) == 1 ? O_WRONLY : (flags & 3) == 2 ? O_RDWR : O_RDONLY;
+                    host_flags |= (flags & 0x8) != 0 ? O_APPEND : 0;
+                    host_flags |= (flags & 0x200) != 0 ? O_CREAT : 0;
+                    host_flags |= (flags & 0x400) != 0 ? O_TRUNC : 0;
+
+                    machine.return_from_system_call(open(path.c_str(), host_flags, (mode_t) machine.read(2)));
+                    break;
+                }
+
+                if (call == 6) {
+                    machine.return_from_system_call(close((int) machine.read(0)));
+                    break;
+                }
+
+                fail(instruction.line, "unsupported system call", std::to_string(call));
+            }
+        }
+    }
+}
+
+void print_usage()
+{
+    printf("usage: ion-sim [options] program.s\n");
+    printf("  --expect N       fail unless the program exits with N\n");
+    printf("  --name NAME      name to report instead of the file path\n");
+    printf("  --max-steps N    stop after N instructions (default 1000000000)\n");
+    printf("  --json           print the counters as json\n");
+}
+
+int main(int argc, char** argv)
+{
+    const char* path = nullptr;
+    const char* name = nullptr;
+    bool json = false;
+    bool has_expectation = false;
+    int expected = 0;
+    uint64_t max_steps = 1000000000ULL;
+
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+
+        if (strcmp(argv[i], "--expect") == 0 && has_value) {
+            has_expectation = true;
+            expected = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--name") == 0 && has_value) {
+            name = argv[++i];
+        } else if (strcmp(argv[i], "--max-steps") == 0 && has_value) {
+            max_steps = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--json") == 0) {
+            json = true;
+        } else if (argv[i][0] == '-') {
+            print_usage();
+            return 2;
+        } else {
+            path = argv[i];
+        }
+    }
+
+    if (path == nullptr) {
+        print_usage();
+        return 2;
+    }
+
+    if (name == nullptr) {
+        name = path;
+    }
+
+    Program program = load_program(path);
+    Machine machine;
+    Counters counters;
+
+    int exit_code = run(program, machine, counters, max_steps);
+    bool passed = !has_expectation || exit_code == expected;
+
+    if (json) {
+        printf("{\"program\": \"%s\", \"exit_code\": %d, \"passed\": %s, \"static_instructions\": %zu, \"instructions\": %llu, \"loads\": %llu, \"stores\": %llu, \"branches\": %llu, \"taken_branches\": %llu}\n",
+               name, exit_code, passed ? "true" : "false", program.instructions.size(),
+               (unsigned long long) counters.instructions, (unsigned long long) counters.loads, (unsigned long long) counters.stores,
+               (unsigned long long) counters.branches, (unsigned long long) counters.taken_branches);
+    } else {
+        printf("%-32s exit %3d %s  static %6zu  dynamic %8llu  loads %6llu  stores %6llu  branches %6llu  taken %6llu\n",
+               name, exit_code, passed ? "ok  " : "FAIL", program.instructions.size(),
+               (unsigned long long) counters.instructions, (unsigned long long) counters.loads, (unsigned long long) counters.stores,
+               (unsigned long long) counters.branches, (unsigned long long) counters.taken_branches);
+    }
+
+    if (!passed) {
+        fprintf(stderr, "ion-sim: %s exited with %d, expected %d\n", name, exit_code, expected);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,130 @@
+#include <cerrno>
+#include <climits>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "emitter.hpp"
+
+#if !defined (IOV_MAX)
+    #define IOV_MAX 1024
+#endif
+
+void Emitter::append_slow(const char* text, size_t length)
+{
+    while (length > 0) {
+        if (used == chunk_size) {
+            chunks.emplace_back(new char[chunk_size]);
+            used = 0;
+        }
+
+        size_t count = chunk_size - used < length ? chunk_size - used : length;
+        memcpy(chunks.back().get() + used, text, count);
+
+        used += count;
+        total += count;
+        text += count;
+        length -= count;
+    }
+}
+
+void Emitter::append(const Emitter& other)
+{
+    for (size_t i = 0; i < other.chunks.size(); i++) {
+        append(other.chunks[i].get(), i + 1 == other.chunks.size() ? other.used : chunk_size);
+    }
+}
+
+Emitter& Emitter::operator<<(int64_t value)
+{
+    // digits are produced back to front into the end of the buffer
+    char buffer[20];
+    char* end = buffer + sizeof(buffer);
+    char* start = end;
+
+    uint64_t magnitude = value < 0 ? 0 - (uint64_t) value : (uint64_t) value;
+
+    do {
+        *--start = (char) ('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude != 0);
+
+    if (value < 0) {
+        *--start = '-';
+    }
+
+    append(start, end - start);
+    return *this;
+}
+
+uint64_t Emitter::instruction_count() const
+{
+    uint64_t count = 0;
+    bool line_start = true;
+    bool indented = false;
+
+    for (size_t i = 0; i < chunks.size(); i++) {
+        const char* chunk = chunks[i].get();
+        size_t length = i + 1 == chunks.size() ? used : chunk_size;
+
+        for (size_t j = 0; j < length; j++) {
+            // indented data directives like '.quad' aren't instructions
+            if (indented && chunk[j] != '.') {
+                count++;
+            }
+
+            indented = line_start && chunk[j] == '\t';
+            line_start = chunk[j] == '\n';
+        }
+    }
+
+    return count;
+}
+
+std::string Emitter::str() const
+{
+    std::string text;
+    text.reserve(total);
+
+    for (size_t i = 0; i < chunks.size(); i++) {
+        text.append(chunks[i].get(), i + 1 == chunks.size() ? used : chunk_size);
+    }
+
+    return text;
+}
+
+bool Emitter::flush(int fd) const
+{
+    std::vector<struct iovec> vectors(chunks.size());
+
+    for (size_t i = 0; i < chunks.size(); i++) {
+        vectors[i].iov_base = chunks[i].get();
+        vectors[i].iov_len = i + 1 == chunks.size() ? used : chunk_size;
+    }
+
+    // normally a single call, but the kernel caps the vector count and may
+    // stop early on a short write
+    size_t next = 0;
+    while (next < vectors.size()) {
+        int count = vectors.size() - next < IOV_MAX ? (int) (vectors.size() - next) : IOV_MAX;
+        ssize_t written = writev(fd, &vectors[next], count);
+
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        while (next < vectors.size() && (size_t) written >= vectors[next].iov_len) {
+            written -= vectors[next].iov_len;
+            next++;
+        }
+
+        if (next < vectors.size()) {
+            vectors[next].iov_base = (char*) vectors[next].iov_base + written;
+            vectors[next].iov_len -= written;
+        }
+    }
+
+    return true;
+}
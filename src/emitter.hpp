@@ -0,0 +1,91 @@
+#ifndef EMITTER_HPP
+#define EMITTER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+// a piece of text whose length is known at compile time, so appending it is a
+// plain memcpy without a strlen
+struct Fragment {
+    const char* text;
+    size_t length;
+
+    template <size_t N>
+    constexpr Fragment(const char (&literal)[N]) : text(literal), length(N - 1) {}
+};
+
+// append-only output buffer for the generated assembly. text goes into fixed
+// size chunks that are never moved once written, and the whole thing is handed
+// to the kernel with writev instead of being copied into one big string first
+struct Emitter {
+    static const size_t chunk_size = 64 * 1024;
+
+    std::vector<std::unique_ptr<char[]>> chunks;
+    size_t used = chunk_size;
+    size_t total = 0;
+
+    void append(const char* text, size_t length)
+    {
+        if (length < chunk_size - used) {
+            memcpy(chunks.back().get() + used, text, length);
+            used += length;
+            total += length;
+            return;
+        }
+
+        append_slow(text, length);
+    }
+
+    template <size_t N>
+    Emitter& operator<<(const char (&literal)[N])
+    {
+        append(literal, N - 1);
+        return *this;
+    }
+
+    Emitter& operator<<(const Fragment& fragment)
+    {
+        append(fragment.text, fragment.length);
+        return *this;
+    }
+
+    Emitter& operator<<(const std::string& text)
+    {
+        append(text.data(), text.size());
+        return *this;
+    }
+
+    Emitter& operator<<(char c)
+    {
+        append(&c, 1);
+        return *this;
+    }
+
+    Emitter& operator<<(int value)
+    {
+        return *this << (int64_t) value;
+    }
+
+    Emitter& operator<<(int64_t value);
+
+    // everything written to other so far
+    void append(const Emitter& other);
+
+    size_t size() const { return total; }
+
+    // every instruction is written as a tab-indented line
+    uint64_t instruction_count() const;
+
+    std::string str() const;
+
+    // writes everything to fd, returns false if the write failed
+    bool flush(int fd) const;
+
+    void append_slow(const char* text, size_t length);
+};
+
+#endif
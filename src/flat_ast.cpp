@@ -0,0 +1,341 @@
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+
+#include "flat_ast.hpp"
+
+#if defined (__APPLE__)
+    #define MODIFIED(info) (info).st_mtimespec
+#else
+    #define MODIFIED(info) (info).st_mtim
+#endif
+
+static const char flat_ast_magic[8] = { 'I', 'O', 'N', 'A', 'S', 'T', 0, 0 };
+
+// the file is the header, then the nodes, then one offset per string into the
+// string bytes plus one for the end, then the string bytes, each string
+// followed by a NUL, then the diagnostics. every section starts 8 byte
+// aligned
+struct FlatLayout {
+    size_t nodes;
+    size_t offsets;
+    size_t strings;
+    size_t diagnostics;
+    size_t total;
+};
+
+FlatLayout flat_layout(uint64_t node_count, uint64_t string_count, uint64_t string_bytes, uint64_t diagnostic_bytes)
+{
+    FlatLayout layout;
+    layout.nodes = sizeof(FlatHeader);
+    layout.offsets = layout.nodes + node_count * sizeof(FlatNode);
+    layout.strings = layout.offsets + (string_count + 1) * sizeof(uint64_t);
+    layout.diagnostics = (layout.strings + string_bytes + 7) & ~(size_t) 7;
+    layout.total = (layout.diagnostics + diagnostic_bytes + 7) & ~(size_t) 7;
+    return layout;
+}
+
+FlatLayout flat_layout(const FlatHeader* header)
+{
+    return flat_layout(header->node_count, header->string_count, header->string_bytes, header->diagnostic_bytes);
+}
+
+// points the header, nodes and string table at an image laid out as above
+void attach(const char* base, FlatAST& ast)
+{
+    ast.header = (const FlatHeader*) base;
+
+    FlatLayout layout = flat_layout(ast.header);
+    ast.nodes = (const FlatNode*) (base + layout.nodes);
+
+    ast.string_offsets = (const uint64_t*) (base + layout.offsets);
+    ast.string_data = base + layout.strings;
+    ast.diagnostics = base + layout.diagnostics;
+}
+
+// whether a node has the children the generator takes for granted when it
+// indexes them, e.g. the condition and the block of a while
+bool valid_child_count(NodeType type, uint32_t count, const char* value)
+{
+    switch (type) {
+        case NodeType::Root:
+        case NodeType::Block:
+        case NodeType::Call:
+            return true;
+        case NodeType::Number:
+        case NodeType::Identifier:
+        case NodeType::Boolean:
+        case NodeType::String:
+            return count == 0;
+        case NodeType::Assignment:
+        case NodeType::Else:
+        case NodeType::Directive:
+            return count == 1;
+        case NodeType::BinaryOperator:
+        case NodeType::ConditionOperator:
+        case NodeType::While:
+            return count == 2;
+        case NodeType::LogicalOperator:
+            return count == (strcmp(value, "!") == 0 ? 1u : 2u);
+        case NodeType::If:
+            return count == 2 || count == 3;
+        case NodeType::Function:
+            return count >= 1;
+        case NodeType::Return:
+            return count <= 1;
+    }
+
+    return false;
+}
+
+// every index in the image and the number of children of every node are
+// checked once here, so nothing that walks the tree has to. children always
+// come after their parent, which also rules out a node being its own
+// descendant
+bool valid_image(const char* base)
+{
+    const FlatHeader* header = (const FlatHeader*) base;
+    FlatLayout layout = flat_layout(header);
+
+    // each string ends in its NUL
+    const uint64_t* offsets = (const uint64_t*) (base + layout.offsets);
+    const char* strings = base + layout.strings;
+
+    if (offsets[0] != 0 || offsets[header->string_count] != header->string_bytes) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < header->string_count; i++) {
+        if (offsets[i + 1] <= offsets[i] || offsets[i + 1] > header->string_bytes || strings[offsets[i + 1] - 1] != '\0') {
+            return false;
+        }
+    }
+
+    const FlatNode* nodes = (const FlatNode*) (base + layout.nodes);
+    if (nodes[0].type != NodeType::Root) {
+        return false;
+    }
+
+    for (uint64_t i = 0; i < header->node_count; i++) {
+        const FlatNode& node = nodes[i];
+
+        if (node.type > NodeType::While || node.value >= header->string_count) {
+            return false;
+        }
+
+        // leaves point at where their children would start as well
+        if (node.first_child <= i || (uint64_t) node.first_child + node.child_count > header->node_count) {
+            return false;
+        }
+
+        if (!valid_child_count(node.type, node.child_count, strings + offsets[node.value])) {
+            return false;
+        }
+    }
+
+    // as many NULs as diagnostics, the last one at the very end
+    const char* diagnostics = base + layout.diagnostics;
+    uint64_t terminated = 0;
+
+    for (uint64_t i = 0; i < header->diagnostic_bytes; i++) {
+        terminated += diagnostics[i] == '\0';
+    }
+
+    if (terminated != header->diagnostic_count || (header->diagnostic_bytes > 0 && diagnostics[header->diagnostic_bytes - 1] != '\0')) {
+        return false;
+    }
+
+    return true;
+}
+
+FlatAST::~FlatAST()
+{
+    if (mapping != nullptr) {
+        munmap((void*) mapping, mapping_size);
+    }
+}
+
+SourceStamp stamp_source(const char* path)
+{
+    SourceStamp stamp;
+    struct stat info;
+
+    if (stat(path, &info) == 0) {
+        stamp.size = info.st_size;
+        stamp.seconds = MODIFIED(info).tv_sec;
+        stamp.nanoseconds = MODIFIED(info).tv_nsec;
+        stamp.inode = info.st_ino;
+    }
+
+    return stamp;
+}
+
+void flatten(const std::shared_ptr<ASTNode>& root, const std::vector<std::string>& diagnostics, const SourceStamp& source, FlatAST& ast)
+{
+    // breadth first, so a node's children are appended in one go right
+    // after everything queued before them
+    std::vector<const ASTNode*> order;
+    order.push_back(root.get());
+
+    for (size_t i = 0; i < order.size(); i++) {
+        for (const auto& child : order[i]->children) {
+            order.push_back(child.get());
+        }
+    }
+
+    if (order.size() > UINT32_MAX) {
+        printf("Program has too many nodes to lay out, exiting...\n");
+        exit(EXIT_FAILURE);
+    }
+
+    std::unordered_map<std::string, uint32_t> interned;
+    std::vector<const std::string*> strings;
+    std::vector<uint32_t> values(order.size());
+    uint64_t string_bytes = 0;
+
+    for (size_t i = 0; i < order.size(); i++) {
+        auto string = interned.find(order[i]->value);
+
+        if (string == interned.end()) {
+            string = interned.insert({ order[i]->value, (uint32_t) strings.size() }).first;
+            strings.push_back(&string->first);
+            string_bytes += string->first.size() + 1;
+        }
+
+        values[i] = string->second;
+    }
+
+    uint64_t diagnostic_bytes = 0;
+    for (const auto& diagnostic : diagnostics) {
+        diagnostic_bytes += diagnostic.size() + 1;
+    }
+
+    FlatLayout layout = flat_layout(order.size(), strings.size(), string_bytes, diagnostic_bytes);
+    ast.image.assign(layout.total / sizeof(uint64_t), 0);
+    char* base = (char*) ast.image.data();
+
+    FlatHeader* header = (FlatHeader*) base;
+    memcpy(header->magic, flat_ast_magic, sizeof(flat_ast_magic));
+    header->version = flat_ast_version;
+    header->node_count = order.size();
+    header->source_size = source.size;
+    header->source_seconds = source.seconds;
+    header->source_nanoseconds = source.nanoseconds;
+    header->source_inode = source.inode;
+    header->string_count = strings.size();
+    header->string_bytes = string_bytes;
+    header->diagnostic_count = diagnostics.size();
+    header->diagnostic_bytes = diagnostic_bytes;
+
+    FlatNode* nodes = (FlatNode*) (base + layout.nodes);
+    uint32_t next_child = 1;
+
+    for (size_t i = 0; i < order.size(); i++) {
+        nodes[i].type = order[i]->type;
+        nodes[i].value = values[i];
+        nodes[i].number = order[i]->number;
+        nodes[i].first_child = next_child;
+        nodes[i].child_count = order[i]->children.size();
+
+        next_child += nodes[i].child_count;
+    }
+
+    uint64_t* offsets = (uint64_t*) (base + layout.offsets);
+    char* string_data = base + layout.strings;
+    uint64_t offset = 0;
+
+    for (size_t i = 0; i < strings.size(); i++) {
+        offsets[i] = offset;
+        memcpy(string_data + offset, strings[i]->data(), strings[i]->size());
+        offset += strings[i]->size() + 1;
+    }
+    offsets[strings.size()] = offset;
+
+    char* diagnostic_data = base + layout.diagnostics;
+    for (const auto& diagnostic : diagnostics) {
+        memcpy(diagnostic_data, diagnostic.data(), diagnostic.size());
+        diagnostic_data += diagnostic.size() + 1;
+    }
+
+    attach(base, ast);
+}
+
+bool write_flat_ast(const FlatAST& ast, const char* path)
+{
+    // written next to the target and renamed over it, so a reader never maps
+    // a half written file. the pid keeps two compiles writing the same cache
+    // at once out of each other's way
+    std::string temporary = std::string(path) + "." + std::to_string(getpid()) + ".tmp";
+
+    int file = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file < 0) {
+        return false;
+    }
+
+    const char* data = (const char*) ast.image.data();
+    size_t length = ast.image.size() * sizeof(uint64_t);
+
+    while (length > 0) {
+        ssize_t count = write(file, data, length);
+        if (count <= 0) {
+            close(file);
+            unlink(temporary.c_str());
+            return false;
+        }
+        data += count;
+        length -= count;
+    }
+
+    close(file);
+    return rename(temporary.c_str(), path) == 0;
+}
+
+bool load_flat_ast(const char* path, const SourceStamp& source, FlatAST& ast)
+{
+    int file = open(path, O_RDONLY);
+    if (file < 0) {
+        return false;
+    }
+
+    struct stat info;
+    if (fstat(file, &info) != 0 || (size_t) info.st_size < sizeof(FlatHeader)) {
+        close(file);
+        return false;
+    }
+
+    void* mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+
+    const FlatHeader* header = (const FlatHeader*) mapping;
+
+    bool usable = memcmp(header->magic, flat_ast_magic, sizeof(flat_ast_magic)) == 0
+        && header->version == flat_ast_version
+        && header->node_count > 0
+        && header->source_size == source.size
+        && header->source_seconds == source.seconds
+        && header->source_nanoseconds == source.nanoseconds
+        && header->source_inode == source.inode
+        && header->string_bytes <= (uint64_t) info.st_size
+        && header->diagnostic_bytes <= (uint64_t) info.st_size
+        && flat_layout(header).total == (size_t) info.st_size
+        && valid_image((const char*) mapping);
+
+    if (!usable) {
+        munmap(mapping, info.st_size);
+        return false;
+    }
+
+    ast.mapping = mapping;
+    ast.mapping_size = info.st_size;
+    attach((const char*) mapping, ast);
+
+    return true;
+}
@@ -0,0 +1,164 @@
+#ifndef FLAT_AST_HPP
+#define FLAT_AST_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "parser.hpp"
+
+// bumped whenever the layout below or the meaning of a node changes, older
+// files are then ignored and rewritten
+static const uint32_t flat_ast_version = 3;
+
+// a finished tree as one block of memory that can be written to a file and
+// mapped back in as is. nodes are stored breadth first so the children of a
+// node are always next to each other, and everything refers to everything
+// else by index, never by address
+struct FlatHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t node_count;
+
+    // the source the tree was built from, checked before the file is used
+    uint64_t source_size;
+    int64_t source_seconds;
+    int64_t source_nanoseconds;
+    uint64_t source_inode;
+
+    uint32_t string_count;
+    uint32_t diagnostic_count;
+    uint64_t string_bytes;
+
+    // the warnings compiling the source gave, NUL terminated one after the
+    // other, so a run that maps the tree in can repeat them
+    uint64_t diagnostic_bytes;
+};
+
+struct FlatNode {
+    NodeType type;
+    uint8_t padding[3];
+
+    // index into the string table
+    uint32_t value;
+
+    int64_t number;
+
+    // index of the first child in the node array
+    uint32_t first_child;
+    uint32_t child_count;
+};
+
+static_assert(sizeof(FlatHeader) == 72, "FlatHeader is part of the file format");
+static_assert(sizeof(FlatNode) == 24, "FlatNode is part of the file format");
+
+// the source file a tree belongs to
+struct SourceStamp {
+    uint64_t size = 0;
+    int64_t seconds = 0;
+    int64_t nanoseconds = 0;
+    uint64_t inode = 0;
+};
+
+struct FlatAST;
+
+// a string inside a FlatAST, valid as long as the FlatAST is. the image keeps
+// a NUL after every string, so data can be handed to printf as it is
+struct StringRef {
+    const char* data;
+    size_t size;
+
+    const char* c_str() const { return data; }
+    std::string str() const { return std::string(data, size); }
+
+    bool operator==(const char* other) const { return strlen(other) == size && memcmp(data, other, size) == 0; }
+    bool operator!=(const char* other) const { return !(*this == other); }
+};
+
+// a node inside a FlatAST, cheap to copy and used like a pointer to ASTNode
+struct Node {
+    const FlatAST* ast;
+    uint32_t index;
+
+    const FlatNode& flat() const;
+
+    NodeType type() const { return flat().type; }
+    int64_t number() const { return flat().number; }
+    StringRef value() const;
+
+    size_t size() const { return flat().child_count; }
+    bool empty() const { return flat().child_count == 0; }
+
+    Node operator[](size_t i) const { return { ast, (uint32_t) (flat().first_child + i) }; }
+    Node back() const { return (*this)[size() - 1]; }
+
+    bool operator==(const Node& other) const { return ast == other.ast && index == other.index; }
+    bool operator!=(const Node& other) const { return !(*this == other); }
+
+    // lets the children be walked with a range for
+    struct Iterator {
+        const FlatAST* ast;
+        uint32_t index;
+
+        Node operator*() const { return { ast, index }; }
+        Iterator& operator++() { index++; return *this; }
+        bool operator!=(const Iterator& other) const { return index != other.index; }
+    };
+
+    Iterator begin() const { return { ast, flat().first_child }; }
+    Iterator end() const { return { ast, flat().first_child + flat().child_count }; }
+};
+
+struct FlatAST {
+    const FlatHeader* header = nullptr;
+    const FlatNode* nodes = nullptr;
+
+    // one offset per distinct string into string_data plus one for the end
+    const uint64_t* string_offsets = nullptr;
+    const char* string_data = nullptr;
+
+    // header->diagnostic_count strings, each right after the previous one's NUL
+    const char* diagnostics = nullptr;
+
+    // either the whole image in memory or a read-only mapping of a file
+    std::vector<uint64_t> image;
+    const void* mapping = nullptr;
+    size_t mapping_size = 0;
+
+    FlatAST() = default;
+    FlatAST(const FlatAST&) = delete;
+    FlatAST& operator=(const FlatAST&) = delete;
+    ~FlatAST();
+
+    Node root() const { return { this, 0 }; }
+    uint32_t size() const { return header->node_count; }
+};
+
+inline const FlatNode& Node::flat() const { return ast->nodes[index]; }
+
+inline StringRef Node::value() const
+{
+    const uint64_t* offsets = ast->string_offsets + flat().value;
+
+    // without the NUL
+    return { ast->string_data + offsets[0], (size_t) (offsets[1] - offsets[0] - 1) };
+}
+
+SourceStamp stamp_source(const char* path);
+
+// lays the tree and the warnings optimize gave for it out into ast's in-memory
+// image
+void flatten(const std::shared_ptr<ASTNode>& root, const std::vector<std::string>& diagnostics, const SourceStamp& source, FlatAST& ast);
+
+// returns false if the file couldn't be written
+bool write_flat_ast(const FlatAST& ast, const char* path);
+
+// maps a file written by write_flat_ast. returns false if there's no such
+// file, it's from another version, it was built from a different source, or
+// an index in it points outside of it
+bool load_flat_ast(const char* path, const SourceStamp& source, FlatAST& ast);
+
+#endif
@@ -1,16 +1,48 @@
+#include <atomic>
 #include <cstdio>
-#include <sstream>
+#include <cstring>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "parser.hpp"
 #include "generator.hpp"
 
-std::vector<std::unordered_map<std::string, Symbol>> st_stack;
+Emitter& operator<<(Emitter& stream, StringRef text)
+{
+    stream.append(text.data, text.size);
+    return stream;
+}
+
+// everything that changes while code is generated is per thread, since the
+// top level statements are generated in chunks on several threads (see
+// generate). what a chunk starts with is worked out up front
+thread_local std::vector<std::unordered_map<std::string, Symbol>> st_stack;
+
+// the first error in what this thread generated. a worker thread can't exit,
+// so the error is kept and generation carries on with stand-ins until the
+// statement is over. generate reports it from the main thread
+thread_local std::string generate_error;
+
+void report_error(const std::string& message)
+{
+    if (generate_error.empty()) {
+        generate_error = message;
+    }
+}
 
-// this insane hack will let us handle up to 8 variables until we start overwriting the symbol
-// table locations. literally the worst solution ever but im too tired to solve it another way
-// right now -_-
-int current_offset = -128;
+// the one place errors leave the generator, always on the main thread
+void stop_on_error(const std::string& error)
+{
+    if (!error.empty()) {
+        printf("%s\n", error.c_str());
+        exit(EXIT_FAILURE);
+    }
+}
+
+// variables live in 8 byte slots above the stack pointer of the current frame,
+// which the prologue reserves up front (see measure_frame)
+thread_local int current_offset = 0;
 
 Symbol declare_variable(const std::string& name) {
     auto& current_scope = st_stack.back();
@@ -22,22 +54,45 @@ Symbol declare_variable(const std::string& name) {
     Symbol symbol = { name, current_offset };
     current_scope[name] = symbol;
 
-    current_offset -= 16;
+    current_offset += 8;
 
     return symbol;
 }
 
-Symbol lookup_variable(const std::string& name) {
+const Symbol* find_variable(const std::string& name) {
     for (int i = st_stack.size() - 1; i >= 0; --i) {
-        auto current_table = st_stack.at(i);
+        const auto& current_table = st_stack[i];
+        auto symbol = current_table.find(name);
 
-        if (current_table.find(name) != current_table.end()) {
-            return current_table[name];
+        if (symbol != current_table.end()) {
+            return &symbol->second;
         }
     }
 
-    printf("Variable '%s' was not found in this scope.\n", name.c_str());
-    exit(EXIT_FAILURE);
+    return nullptr;
+}
+
+Symbol lookup_variable(const std::string& name) {
+    const Symbol* symbol = find_variable(name);
+
+    if (symbol == nullptr) {
+        report_error("Variable '" + name + "' was not found in this scope.");
+        return { name, 0 };
+    }
+
+    return *symbol;
+}
+
+// assigning to a variable from an enclosing scope updates it, anything else
+// declares a new one in the current scope
+Symbol assign_variable(const std::string& name) {
+    const Symbol* symbol = find_variable(name);
+
+    if (symbol != nullptr) {
+        return *symbol;
+    }
+
+    return declare_variable(name);
 }
 
 void enter_scope() {
@@ -45,114 +100,749 @@ void enter_scope() {
     st_stack.push_back(this_scope);
 }
 
-void exit_scope(std::stringstream& stream) {
-    auto& current_scope = st_stack.back();
+void exit_scope() {
+    // scopes close in reverse order, so this scope's slots are always the
+    // most recently handed out ones and can be reused by the next scope
+    current_offset -= 8 * st_stack.back().size();
+
+    st_stack.pop_back();
+}
+
+// walks a body the same way declare_variable/enter_scope/exit_scope will and
+// records the most slots that are ever live at once
+void measure_frame(Node node, std::vector<std::unordered_set<std::string>>& scopes, int& peak)
+{
+    switch (node.type()) {
+        case NodeType::Function: {
+            // has a frame of its own
+            return;
+        }
+        case NodeType::Block: {
+            scopes.emplace_back();
+            for (Node child : node) {
+                measure_frame(child, scopes, peak);
+            }
+            scopes.pop_back();
+            return;
+        }
+        case NodeType::Assignment: {
+            measure_frame(node[0], scopes, peak);
+
+            for (const auto& scope : scopes) {
+                if (scope.count(node.value().str()) != 0) {
+                    return;
+                }
+            }
+            scopes.back().insert(node.value().str());
 
-    for (int i = 0; i < current_scope.size(); i++) {
-        stream << "\tldr x1, [sp], 16\n";
-        current_offset += 16;
+            int live = 0;
+            for (const auto& scope : scopes) {
+                live += scope.size();
+            }
+            if (live > peak) {
+                peak = live;
+            }
+            return;
+        }
+        default: {
+            for (Node child : node) {
+                measure_frame(child, scopes, peak);
+            }
+            return;
+        }
     }
+}
 
-    st_stack.pop_back();
+// frame size in bytes for the statements under a node, with parameters taking the
+// first slots. sp has to stay 16 byte aligned, so this rounds up
+int frame_size(Node statements, const std::vector<std::string>& parameters)
+{
+    std::vector<std::unordered_set<std::string>> scopes(1);
+    scopes[0].insert(parameters.begin(), parameters.end());
+
+    int peak = scopes[0].size();
+    for (Node statement : statements) {
+        measure_frame(statement, scopes, peak);
+    }
+
+    return (peak * 8 + 15) & ~15;
+}
+
+// add/sub only take a 12 bit immediate, optionally shifted left by 12
+void adjust_stack_pointer(const Fragment& mnemonic, int bytes, Emitter& stream)
+{
+    if (bytes >= 4096) {
+        stream << "\t" << mnemonic << " sp, sp, #" << (bytes >> 12) << ", lsl #12\n";
+    }
+    if ((bytes & 4095) != 0) {
+        stream << "\t" << mnemonic << " sp, sp, #" << (bytes & 4095) << "\n";
+    }
 }
 
-const char* condition_operator_to_arm64_condition_flag(const std::string& cond_operator)
+bool contains_call(Node node)
+{
+    if (node.type() == NodeType::Call) {
+        return true;
+    }
+
+    for (Node child : node) {
+        if (contains_call(child)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// negate gives the flag for the opposite outcome, for branching when the
+// condition does not hold
+Fragment condition_operator_to_arm64_condition_flag(StringRef cond_operator, bool negate)
 {
     if (cond_operator == "==") {
-        return "EQ";
+        return negate ? "NE" : "EQ";
     }
     if (cond_operator == "!=") {
-        return "NE";
+        return negate ? "EQ" : "NE";
     }
     if (cond_operator == ">") {
-        return "GT";
+        return negate ? "LE" : "GT";
     }
     if (cond_operator == "<") {
-        return "LT";
+        return negate ? "GE" : "LT";
     }
     if (cond_operator == ">=") {
-        return "LE";
+        return negate ? "GT" : "LE";
     }
     if (cond_operator == "<=") {
-        return "GE";
+        return negate ? "LT" : "GE";
+    }
+
+    report_error("Unknown condition operator " + cond_operator.str() + ", cannot continue.");
+    return "EQ";
+}
+
+// constants that would need three or four mov instructions are loaded from a
+// read-only pool instead, with one entry per distinct value
+// each chunk numbers its entries from its own base, so the numbers don't
+// depend on the order the chunks finish in
+thread_local std::unordered_map<int64_t, int> literal_pool;
+thread_local std::vector<int64_t> literal_pool_values;
+thread_local int literal_base = 0;
+
+bool is_shifted_mask(uint64_t value)
+{
+    uint64_t filled = (value - 1) | value;
+    return value != 0 && ((filled + 1) & filled) == 0;
+}
+
+// whether value fits the N:immr:imms encoding of the logical instructions,
+// meaning a single 'mov' (orr with xzr) can produce it
+bool is_bitmask_immediate(uint64_t value)
+{
+    if (value == 0 || value == ~0ULL) {
+        return false;
+    }
+
+    // find the smallest element size the value repeats at
+    int size = 64;
+    do {
+        size /= 2;
+        uint64_t mask = (1ULL << size) - 1;
+
+        if ((value & mask) != ((value >> size) & mask)) {
+            size *= 2;
+            break;
+        }
+    } while (size > 2);
+
+    uint64_t mask = size == 64 ? ~0ULL : (1ULL << size) - 1;
+    uint64_t element = value & mask;
+
+    // the element has to be a (possibly wrapped around) run of ones
+    return is_shifted_mask(element) || is_shifted_mask(~(element | ~mask));
+}
+
+// loads value into x<target>
+void materialize_constant(int64_t value, int target, Emitter& stream)
+{
+    uint64_t bits = (uint64_t) value;
+
+    int movz_count = 0;
+    int movn_count = 0;
+    for (int shift = 0; shift < 64; shift += 16) {
+        uint64_t halfword = (bits >> shift) & 0xffff;
+        movz_count += halfword != 0 ? 1 : 0;
+        movn_count += halfword != 0xffff ? 1 : 0;
+    }
+
+    // one movz, one movn or one orr, the assembler picks which for 'mov'
+    if (movz_count <= 1 || movn_count <= 1 || is_bitmask_immediate(bits)) {
+        stream << "\tmov x" << target << ", #" << value << "\n";
+        return;
+    }
+
+    if (movz_count == 2 || movn_count == 2) {
+        bool inverted = movz_count != 2;
+        uint64_t skip = inverted ? 0xffff : 0;
+        bool first = true;
+
+        for (int shift = 0; shift < 64; shift += 16) {
+            uint64_t halfword = (bits >> shift) & 0xffff;
+            if (halfword == skip) {
+                continue;
+            }
+
+            if (first) {
+                stream << (inverted ? Fragment("\tmovn x") : Fragment("\tmovz x")) << target << ", #" << (int64_t) (inverted ? ~halfword & 0xffff : halfword);
+                first = false;
+            } else {
+                stream << "\tmovk x" << target << ", #" << (int64_t) halfword;
+            }
+            stream << ", lsl #" << shift << "\n";
+        }
+
+        return;
+    }
+
+    auto entry = literal_pool.find(value);
+    int index = 0;
+
+    if (entry == literal_pool.end()) {
+        index = literal_base + literal_pool_values.size();
+        literal_pool[value] = index;
+        literal_pool_values.push_back(value);
+    } else {
+        index = entry->second;
+    }
+
+    stream << "\tadrp x" << target << ", _lit" << index << "@PAGE\n";
+    stream << "\tldr x" << target << ", [x" << target << ", _lit" << index << "@PAGEOFF]\n";
+}
+
+bool is_power_of_two(uint64_t value)
+{
+    return value != 0 && (value & (value - 1)) == 0;
+}
+
+int log2_exact(uint64_t value)
+{
+    int shift = 0;
+    while ((value >>= 1) != 0) {
+        shift++;
+    }
+
+    return shift;
+}
+
+// x0 = x0 * value, shifting instead of multiplying when the constant is a
+// power of two or the negation of one
+void multiply_by_constant(int64_t value, Emitter& stream)
+{
+    uint64_t bits = (uint64_t) value;
+    uint64_t negated = 0 - bits;
+
+    if (bits == 0) {
+        stream << "\tmov x0, #0\n";
+    } else if (bits == 1) {
+        return;
+    } else if (is_power_of_two(bits)) {
+        stream << "\tlsl x0, x0, #" << log2_exact(bits) << "\n";
+    } else if (is_power_of_two(negated)) {
+        if (negated != 1) {
+            stream << "\tlsl x0, x0, #" << log2_exact(negated) << "\n";
+        }
+        stream << "\tneg x0, x0\n";
+    } else {
+        materialize_constant(value, 1, stream);
+        stream << "\tmul x0, x0, x1\n";
+    }
+}
+
+// multiplier and shift such that n / divisor is the high half of
+// n * multiplier shifted right, from Hacker's Delight (10-1) widened to 64
+// bits. divisor must not be -1, 0 or 1
+void signed_division_magic(int64_t divisor, int64_t& multiplier, int& shift)
+{
+    const uint64_t two63 = 1ULL << 63;
+
+    uint64_t absolute = divisor < 0 ? 0 - (uint64_t) divisor : (uint64_t) divisor;
+    uint64_t t = two63 + ((uint64_t) divisor >> 63);
+    uint64_t anc = t - 1 - t % absolute;
+
+    uint64_t q1 = two63 / anc;
+    uint64_t r1 = two63 - q1 * anc;
+    uint64_t q2 = two63 / absolute;
+    uint64_t r2 = two63 - q2 * absolute;
+    uint64_t delta = 0;
+    int p = 63;
+
+    do {
+        p++;
+
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= anc) {
+            q1++;
+            r1 -= anc;
+        }
+
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= absolute) {
+            q2++;
+            r2 -= absolute;
+        }
+
+        delta = absolute - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+
+    multiplier = (int64_t) (q2 + 1);
+    if (divisor < 0) {
+        multiplier = (int64_t) (0 - (uint64_t) multiplier);
+    }
+    shift = p - 64;
+}
+
+// x0 = x0 / value rounding towards zero like sdiv, without the sdiv
+void divide_by_constant(int64_t value, Emitter& stream)
+{
+    uint64_t magnitude = value < 0 ? 0 - (uint64_t) value : (uint64_t) value;
+
+    if (value == 0) {
+        // sdiv gives 0 for a zero divisor rather than trapping
+        stream << "\tmov x0, #0\n";
+        return;
+    }
+
+    if (magnitude == 1) {
+        if (value < 0) {
+            stream << "\tneg x0, x0\n";
+        }
+        return;
+    }
+
+    if (is_power_of_two(magnitude)) {
+        int shift = log2_exact(magnitude);
+
+        // an arithmetic shift rounds down, so negative dividends get
+        // 2^shift - 1 added first to round towards zero instead
+        stream << "\tasr x1, x0, #63\n";
+        stream << "\tadd x0, x0, x1, lsr #" << 64 - shift << "\n";
+        stream << "\tasr x0, x0, #" << shift << "\n";
+
+        if (value < 0) {
+            stream << "\tneg x0, x0\n";
+        }
+        return;
+    }
+
+    int64_t multiplier = 0;
+    int shift = 0;
+    signed_division_magic(value, multiplier, shift);
+
+    materialize_constant(multiplier, 1, stream);
+    stream << "\tsmulh x1, x0, x1\n";
+
+    // the multiplier's sign came out wrong for a 64 bit signed value, which
+    // is made up for by adding or subtracting the dividend once
+    if (value > 0 && multiplier < 0) {
+        stream << "\tadd x1, x1, x0\n";
+    } else if (value < 0 && multiplier > 0) {
+        stream << "\tsub x1, x1, x0\n";
+    }
+
+    if (shift > 0) {
+        stream << "\tasr x1, x1, #" << shift << "\n";
+    }
+
+    // plus one for negative quotients, which rounds them towards zero
+    stream << "\tadd x0, x1, x1, lsr #63\n";
+}
+
+// entries are the pool index and value of every chunk's constants in order.
+// chunks only share entries among themselves, so a value used by several
+// gets all their labels on the one copy
+void generate_literal_pool(const std::vector<std::pair<int, int64_t>>& entries, Emitter& stream)
+{
+    if (entries.empty()) {
+        return;
+    }
+
+    std::vector<int64_t> values;
+    std::unordered_map<int64_t, std::vector<int>> labels;
+
+    for (const auto& entry : entries) {
+        auto& indices = labels[entry.second];
+        if (indices.empty()) {
+            values.push_back(entry.second);
+        }
+        indices.push_back(entry.first);
+    }
+
+    stream << "\n.section __TEXT,__const\n";
+    stream << ".p2align 3\n";
+
+    for (int64_t value : values) {
+        for (int index : labels[value]) {
+            stream << "_lit" << index << ":\n";
+        }
+        stream << "\t.quad " << value << "\n";
+    }
+}
+
+// every distinct string literal gets one symbol in the cstring section, so
+// repeated messages share their bytes
+thread_local std::unordered_map<std::string, int> string_pool;
+thread_local std::vector<const std::string*> string_pool_values;
+thread_local int string_base = 0;
+
+int intern_string(const std::string& value)
+{
+    auto entry = string_pool.find(value);
+    if (entry != string_pool.end()) {
+        return entry->second;
+    }
+
+    int index = string_base + string_pool_values.size();
+    auto inserted = string_pool.insert({ value, index });
+    string_pool_values.push_back(&inserted.first->first);
+
+    return index;
+}
+
+void generate_string_pool(const std::vector<std::pair<int, const std::string*>>& entries, Emitter& stream)
+{
+    if (entries.empty()) {
+        return;
+    }
+
+    std::vector<const std::string*> values;
+    std::unordered_map<std::string, std::vector<int>> labels;
+
+    for (const auto& entry : entries) {
+        auto& indices = labels[*entry.second];
+        if (indices.empty()) {
+            values.push_back(entry.second);
+        }
+        indices.push_back(entry.first);
     }
 
-    // maybe we should fail more gracefully here?
-    printf("Unknown condition operator %s, cannot continue.", cond_operator.c_str());
-    exit(EXIT_FAILURE);
+    stream << "\n.section __TEXT,__cstring\n";
+
+    for (const std::string* value : values) {
+        for (int index : labels[*value]) {
+            stream << "_str" << index << ":\n";
+        }
+        stream << "\t.asciz \"";
+
+        for (char c : *value) {
+            if (c == '"' || c == '\\') {
+                stream << '\\' << c;
+            } else if (c < ' ' || c == 127) {
+                // octal escapes work for every byte and never run into the next character
+                char escape[4] = { '\\', (char) ('0' + ((c >> 6) & 3)), (char) ('0' + ((c >> 3) & 7)), (char) ('0' + (c & 7)) };
+                stream.append(escape, sizeof(escape));
+            } else {
+                stream << c;
+            }
+        }
+
+        stream << "\"\n";
+    }
 }
 
-int pointer = 0;
+thread_local int pointer = 0;
+
+// top level functions by name, and the one whose body is being generated
+std::unordered_map<std::string, Node> functions;
+thread_local Node current_function = { nullptr, 0 };
 
 // used to calculate jump labels for jumping back into the main method
-int jump_index = 0;
+thread_local int jump_index = 0;
+
+// frame slot of the variable whose value is in x0, or -1. only known right
+// after a load or store of it, and forgotten at every label since another
+// path can jump there with anything in x0
+thread_local int x0_variable = -1;
+
+void emit_label(const Fragment& prefix, int index, Emitter& stream)
+{
+    stream << prefix << index << ":\n";
+    x0_variable = -1;
+}
+
+void generate_code(Node node, Emitter& stream);
+
+// --instrument counts how often every if is reached and how often its then
+// block runs, --profile-use reads those counts back to decide the layout.
+// ifs are numbered in the order they're generated, which is the same in both
+bool instrument = false;
+const Profile* branch_profile = nullptr;
+thread_local int branch_index = 0;
+
+// arms the profile says run less often, generated in place so scopes and the
+// stack are as they would be there, but emitted after the current function
+thread_local std::vector<std::unique_ptr<Emitter>> cold_code;
+
+// x9 and x10 never hold anything across statements
+void count_branch(int counter, Emitter& stream)
+{
+    int offset = counter * 8;
+
+    stream << "\tadrp x9, _profile_counters@PAGE\n";
+    stream << "\tadd x9, x9, _profile_counters@PAGEOFF\n";
+
+    // ldr only reaches 32760 bytes past the base
+    if (offset > 32760) {
+        stream << "\tadd x9, x9, #" << (offset >> 12) << ", lsl #12\n";
+        offset &= 4095;
+    }
+
+    stream << "\tldr x10, [x9, " << offset << "]\n";
+    stream << "\tadd x10, x10, #1\n";
+    stream << "\tstr x10, [x9, " << offset << "]\n";
+}
+
+// <prefix><index>: block, then back to the end of the if. counter is the one
+// to bump on the way in when instrumenting, or -1
+void generate_out_of_line(const Fragment& prefix, int index, Node block, int counter, Emitter& stream)
+{
+    cold_code.emplace_back(new Emitter());
+    Emitter& cold = *cold_code.back();
+
+    emit_label(prefix, index, cold);
+
+    if (instrument && counter >= 0) {
+        count_branch(counter, cold);
+    }
+    generate_code(block, cold);
+
+    cold << "\tb _main_" << index << "\n";
+
+    // the code in line continues from the branch, not from the cold block
+    x0_variable = -1;
+}
+
+void flush_cold_code(Emitter& stream)
+{
+    for (const auto& cold : cold_code) {
+        stream.append(*cold);
+    }
+
+    cold_code.clear();
+}
+
+bool is_system_call(StringRef line)
+{
+    size_t start = 0;
+    while (start < line.size && (line.data[start] == ' ' || line.data[start] == '\t')) {
+        start++;
+    }
+
+    return line.size - start >= 3 && memcmp(line.data + start, "svc", 3) == 0;
+}
+
+// the counters are dumped to PROFILE_PATH behind the header the profile file
+// starts with. the mode is 0644 and the flags are macOS's
+// O_WRONLY | O_CREAT | O_TRUNC. if the open fails, which sets the carry flag
+// and leaves errno in x0, nothing is written
+void generate_profile_support(uint64_t hash, Emitter& stream)
+{
+    stream << "\n_profile_dump:\n";
+    stream << "\tcmp x16, #1\n";
+    stream << "\tb.ne _profile_done\n";
+    stream << "\tstp x0, x16, [sp, -16]!\n";
+    stream << "\tadrp x0, _profile_path@PAGE\n";
+    stream << "\tadd x0, x0, _profile_path@PAGEOFF\n";
+    stream << "\tmov x1, #1537\n";
+    stream << "\tmov x2, #420\n";
+    stream << "\tmov x16, #5\n";
+    stream << "\tsvc #0\n";
+    stream << "\tb.cs _profile_restore\n";
+    stream << "\tmov x9, x0\n";
+    stream << "\tadrp x1, _profile_header@PAGE\n";
+    stream << "\tadd x1, x1, _profile_header@PAGEOFF\n";
+    stream << "\tmov x2, #32\n";
+    stream << "\tmov x16, #4\n";
+    stream << "\tsvc #0\n";
+    stream << "\tmov x0, x9\n";
+    stream << "\tadrp x1, _profile_counters@PAGE\n";
+    stream << "\tadd x1, x1, _profile_counters@PAGEOFF\n";
+    materialize_constant(16 * (int64_t) branch_index, 2, stream);
+    stream << "\tmov x16, #4\n";
+    stream << "\tsvc #0\n";
+    stream << "\tmov x0, x9\n";
+    stream << "\tmov x16, #6\n";
+    stream << "\tsvc #0\n";
+    stream << "_profile_restore:\n";
+    stream << "\tldp x0, x16, [sp], 16\n";
+    stream << "_profile_done:\n";
+    stream << "\tret\n";
+
+    stream << "\n.data\n";
+    stream << ".p2align 3\n";
+    stream << "_profile_header:\n";
+    stream << "\t.quad " << (int64_t) profile_magic << "\n";
+    stream << "\t.quad " << (int64_t) profile_version << "\n";
+    stream << "\t.quad " << (int64_t) hash << "\n";
+    stream << "\t.quad " << branch_index << "\n";
+    stream << "_profile_path:\n";
+    stream << "\t.asciz \"" << PROFILE_PATH << "\"\n";
+
+    stream << "\n.zerofill __DATA,__bss,_profile_counters," << 16 * (int64_t) branch_index << ",3\n";
+}
 
-void generate_code(const std::shared_ptr<ASTNode>& node, std::stringstream& stream)
+// jumps to <prefix><index> when the condition evaluates to jump_when and falls
+// through otherwise. && and || never produce a value here, every operand that
+// gets evaluated costs exactly one compare-and-branch
+void generate_branch(Node node, const Fragment& prefix, int index, bool jump_when, Emitter& stream)
 {
-    switch (node->type) {
+    switch (node.type()) {
+        case NodeType::ConditionOperator: {
+            generate_code(node, stream);
+
+            stream << "\tb." << condition_operator_to_arm64_condition_flag(node.value(), !jump_when) << " " << prefix << index << "\n";
+
+            return;
+        }
+        case NodeType::Boolean: {
+            if ((node.value() == "true") == jump_when) {
+                stream << "\tb " << prefix << index << "\n";
+            }
+
+            return;
+        }
+        case NodeType::LogicalOperator: {
+            if (node.value() == "!") {
+                generate_branch(node[0], prefix, index, !jump_when, stream);
+                return;
+            }
+
+            // the left operand alone decides the outcome when it's false for
+            // && or true for ||. if that outcome is the one we jump on, both
+            // operands can branch straight to the target
+            bool decided_by_left = node.value() == "||";
+
+            if (decided_by_left == jump_when) {
+                generate_branch(node[0], prefix, index, jump_when, stream);
+                generate_branch(node[1], prefix, index, jump_when, stream);
+                return;
+            }
+
+            int skip = jump_index++;
+
+            generate_branch(node[0], "_skip", skip, decided_by_left, stream);
+            generate_branch(node[1], prefix, index, jump_when, stream);
+
+            emit_label("_skip", skip, stream);
+
+            return;
+        }
+        default: {
+            generate_code(node, stream);
+
+            stream << "\t" << (jump_when ? Fragment("cbnz") : Fragment("cbz")) << " x0, " << prefix << index << "\n";
+
+            return;
+        }
+    }
+}
+
+void generate_code(Node node, Emitter& stream)
+{
+    // a node that leaves a variable's value in x0 says so here, anything
+    // else may have clobbered it
+    int cached = x0_variable;
+    int holds = -1;
+
+    switch (node.type()) {
         case NodeType::Root: {
-            for (int i = 0; i < node->children.size(); i++) {
-                generate_code(node->children[i], stream);
+            for (size_t i = 0; i < node.size(); i++) {
+                // functions are generated after _main, see generate()
+                if (node[i].type() != NodeType::Function) {
+                    generate_code(node[i], stream);
+                }
             }
             break;
         }
         case NodeType::Number: {
-            stream << "\tmov x0, #" << node->value << "\n";
+            materialize_constant(node.number(), 0, stream);
 
             break;
         }
         case NodeType::BinaryOperator: {
-            generate_code(node->children[0], stream);
+            Node right = node[1];
+
+            // a constant operand goes straight into x1, and multiplying or
+            // dividing by one usually doesn't need mul or sdiv at all
+            if (right.type() == NodeType::Number && (node.value() == "*" || node.value() == "/")) {
+                generate_code(node[0], stream);
+
+                if (node.value() == "*") {
+                    multiply_by_constant(right.number(), stream);
+                } else {
+                    divide_by_constant(right.number(), stream);
+                }
+
+                break;
+            }
+
+            generate_code(node[0], stream);
             stream << "\tstr x0, [sp, -16]!\n";
             pointer -= 16;
 
-            generate_code(node->children[1], stream);
+            generate_code(node[1], stream);
             stream << "\tldr x1, [sp], 16\n";
             pointer += 16;
 
-            if (node->value == "+") {
+            if (node.value() == "+") {
                 stream << "\tadd x0, x1, x0\n";
-            } else if (node->value == "-") {
+            } else if (node.value() == "-") {
                 stream << "\tsub x0, x1, x0\n";
-            } else if (node->value == "*") {
+            } else if (node.value() == "*") {
                 stream << "\tmul x0, x1, x0\n";
-            } else if (node->value == "/") {
+            } else if (node.value() == "/") {
                 stream << "\tsdiv x0, x1, x0\n";
             }
 
             break;
         }
         case NodeType::Assignment: {
-            generate_code(node->children[0], stream);
+            generate_code(node[0], stream);
 
-            auto symbol = declare_variable(node->value);
+            auto symbol = assign_variable(node.value().str());
             int memory_location = symbol.memory_location - pointer;
 
             stream << "\tstr x0, [sp, " << memory_location << "]\n";
+            holds = symbol.memory_location;
 
             break;
         }
         case NodeType::Identifier: {
-            auto symbol = lookup_variable(node->value);
+            auto symbol = lookup_variable(node.value().str());
             int memory_location = symbol.memory_location - pointer;
 
-            stream << "\tldr x0, [sp, " << memory_location << "]\n";
+            // e.g. reading a variable right after assigning it
+            if (cached != symbol.memory_location) {
+                stream << "\tldr x0, [sp, " << memory_location << "]\n";
+            }
+            holds = symbol.memory_location;
 
             break;
         }
         case NodeType::Boolean: {
-            int bool_value = node->value == "true" ? 1 : 0;
+            int bool_value = node.value() == "true" ? 1 : 0;
 
             stream << "\tmov x0, #" << bool_value << "\n";
 
             break;
         }
         case NodeType::ConditionOperator: {
-            generate_code(node->children[0], stream);
+            generate_code(node[0], stream);
             stream << "\tstr x0, [sp, -16]!\n";
             pointer -= 16;
 
-            generate_code(node->children[1], stream);
+            generate_code(node[1], stream);
             stream << "\tldr x1, [sp], 16\n";
             pointer += 16;
 
@@ -161,88 +851,614 @@ void generate_code(const std::shared_ptr<ASTNode>& node, std::stringstream& stre
             break;
         }
         case NodeType::If: {
-            std::shared_ptr<ASTNode> expression_node = node->children.at(0);
+            // taken up front so ifs nested in either block get their own labels
+            int label = jump_index++;
+            int branch = branch_index++;
+            bool has_else = node.back().type() == NodeType::Else;
 
-            generate_code(expression_node, stream); // expression
+            if (instrument) {
+                count_branch(2 * branch, stream);
+            }
 
-            if (expression_node->type == NodeType::ConditionOperator) {
-                const char* condition_flag = condition_operator_to_arm64_condition_flag(expression_node->value);
+            const BranchCounts* counts = nullptr;
+            if (branch_profile != nullptr && branch < (int) branch_profile->branches.size() && branch_profile->branches[branch].reached > 0) {
+                counts = &branch_profile->branches[branch];
+            }
 
-                // maybe calculate label at lexer time, and put it in the value for the if node?
-                // store jump labels somewhere (symbol table?) or above method
-                stream << "\tb." << condition_flag << " _if" << jump_index << "\n";
-            } else if (expression_node->type == NodeType::Boolean) {
-                stream << "\tcmp x0, #1\n";
+            // the arm that ran less often moves out of line, so the one that
+            // ran more falls straight out of the condition and into whatever
+            // follows the if without a taken branch
+            if (counts != nullptr && counts->then_count < counts->reached - counts->then_count) {
+                generate_branch(node[0], "_then", label, true, stream);
+                generate_out_of_line("_then", label, node[1], 2 * branch + 1, stream);
 
-                stream << "\tb.eq _if" << jump_index << "\n";
+                if (has_else) {
+                    generate_code(node.back(), stream);
+                }
 
-                // we should be able to fold at least one branch here no?
+                emit_label("_main_", label, stream);
+                break;
             }
 
-            if (node->children.at(node->children.size() - 1)->type == NodeType::Else) {
-                generate_code(node->children[node->children.size() - 1], stream);
-            } else {
-                // generate an empty else for current jump index as to not fall through
-                stream << "_else" << jump_index << ":\n";
+            if (counts != nullptr && has_else) {
+                generate_branch(node[0], "_else", label, false, stream);
+                generate_out_of_line("_else", label, node.back(), -1, stream);
+
+                if (instrument) {
+                    count_branch(2 * branch + 1, stream);
+                }
+                generate_code(node[1], stream);
+
+                emit_label("_main_", label, stream);
+                break;
             }
 
-            stream << "_if" << jump_index << ":\n";
-            generate_code(node->children[1], stream);
+            // without a profile the then block falls straight out of the
+            // condition, a failing condition jumps over it
+            generate_branch(node[0], has_else ? Fragment("_else") : Fragment("_main_"), label, false, stream);
 
-            stream << "_main_" << jump_index << ":\n";
+            if (instrument) {
+                count_branch(2 * branch + 1, stream);
+            }
+            generate_code(node[1], stream);
+
+            if (has_else) {
+                stream << "\tb _main_" << label << "\n";
+                emit_label("_else", label, stream);
+
+                generate_code(node.back(), stream);
+            }
 
-            jump_index++;
+            emit_label("_main_", label, stream);
 
             break;
         }
         case NodeType::Else: {
-            stream << "_else" << jump_index << ":\n";
-
-            generate_code(node->children[0], stream);
+            generate_code(node[0], stream);
 
             break;
         }
         case NodeType::Block: {
             enter_scope();
 
-            for (int i = 0; i < node->children.size(); i++) {
-                generate_code(node->children[i], stream);
+            for (size_t i = 0; i < node.size(); i++) {
+                generate_code(node[i], stream);
             }
 
-            exit_scope(stream);
+            exit_scope();
+
+            break;
+        }
+        case NodeType::While: {
+            int label = jump_index++;
+
+            // rotated so each iteration costs one conditional branch at the
+            // bottom, the condition is entered once from the top
+            stream << "\tb _cond" << label << "\n";
+            emit_label("_loop", label, stream);
+
+            // the body block's slots are reserved by the prologue, so
+            // nothing is pushed or popped per iteration
+            generate_code(node[1], stream);
+
+            emit_label("_cond", label, stream);
+            generate_branch(node[0], "_loop", label, true, stream);
+
+            break;
+        }
+        case NodeType::LogicalOperator: {
+            // as a value, the result is materialized from the same branch chain
+            int label = jump_index++;
+
+            generate_branch(node, "_false", label, false, stream);
 
-            stream << "\tb _main_" << jump_index << "\n";
+            stream << "\tmov x0, #1\n";
+            stream << "\tb _done" << label << "\n";
+            emit_label("_false", label, stream);
+            stream << "\tmov x0, #0\n";
+            emit_label("_done", label, stream);
 
             break;
         }
         case NodeType::Directive: {
-            std::string directive_type = node->value;
+            StringRef directive_type = node.value();
 
             if (directive_type == "asm") {
-                for (int i = 0; i < node->children[0]->children.size(); i++) {
+                for (size_t i = 0; i < node[0].size(); i++) {
+                    StringRef line = node[0][i].value();
+
+                    // the exit system call is the last chance to write the
+                    // counters out. x30 is kept for any other system call
+                    if (instrument && is_system_call(line)) {
+                        stream << "\tstr x30, [sp, -16]!\n";
+                        stream << "\tbl _profile_dump\n";
+                        stream << "\tldr x30, [sp], 16\n";
+                    }
+
                     // lets hops the user knows assembly :)
                     // also, indent this depending on scope, maybe??
-                    stream << "\t" << node->children[0]->children[i]->value << "\n";
+                    stream << "\t" << line << "\n";
                 }
             }
 
             break;
         }
+        case NodeType::Function: {
+            report_error("Function '" + node.value().str() + "' has to be declared at the top level.");
+            break;
+        }
+        case NodeType::Call: {
+            auto function = functions.find(node.value().str());
+            if (function == functions.end()) {
+                report_error("Function '" + node.value().str() + "' was not found.");
+                break;
+            }
+
+            int argument_count = node.size();
+            if (argument_count != (int) function->second.size() - 1) {
+                report_error("Function '" + node.value().str() + "' expects " + std::to_string((int) function->second.size() - 1) + " arguments but got " + std::to_string(argument_count) + ".");
+                break;
+            }
+
+            // arguments are evaluated left to right and parked on the stack,
+            // except the last one which can go straight to its register
+            for (int i = 0; i + 1 < argument_count; i++) {
+                generate_code(node[i], stream);
+                stream << "\tstr x0, [sp, -16]!\n";
+                pointer -= 16;
+            }
+
+            if (argument_count > 0) {
+                generate_code(node[argument_count - 1], stream);
+
+                if (argument_count > 1) {
+                    stream << "\tmov x" << argument_count - 1 << ", x0\n";
+                }
+            }
+
+            for (int i = argument_count - 2; i >= 0; i--) {
+                stream << "\tldr x" << i << ", [sp], 16\n";
+                pointer += 16;
+            }
+
+            stream << "\tbl _fn_" << node.value() << "\n";
+
+            break;
+        }
+        case NodeType::Return: {
+            if (current_function.ast == nullptr) {
+                report_error("Return outside of a function.");
+                break;
+            }
+
+            if (!node.empty()) {
+                generate_code(node[0], stream);
+            }
+
+            stream << "\tb _fn_" << current_function.value() << "_return\n";
+
+            break;
+        }
         case NodeType::String: {
-            // @todo handle string case
+            int index = intern_string(node.value().str());
+
+            stream << "\tadrp x0, _str" << index << "@PAGE\n";
+            stream << "\tadd x0, x0, _str" << index << "@PAGEOFF\n";
+
+            break;
+        }
+    }
+
+    x0_variable = holds;
+}
+
+
+// AAPCS64: arguments arrive in x0-x7 and the result leaves in x0. we never keep
+// values in x19-x28, so the only callee saved registers to preserve are the
+// frame pointer and link register, and a leaf function doesn't touch those
+void generate_function(Node node, Emitter& stream)
+{
+    std::vector<std::string> parameters;
+    for (size_t i = 0; i + 1 < node.size(); i++) {
+        parameters.push_back(node[i].value().str());
+    }
+
+    if (parameters.size() > 8) {
+        report_error("Function '" + node.value().str() + "' takes more than 8 parameters, which is not supported.");
+        return;
+    }
+
+    Node body = node.back();
+    bool leaf = !contains_call(body);
+    int frame = frame_size(body, parameters);
+
+    stream << "\n_fn_" << node.value() << ":\n";
+
+    if (!leaf) {
+        stream << "\tstp x29, x30, [sp, -16]!\n";
+        stream << "\tmov x29, sp\n";
+    }
+    adjust_stack_pointer("sub", frame, stream);
+
+    current_function = node;
+    pointer = 0;
+    current_offset = 0;
+    x0_variable = -1;
+    st_stack.clear();
+    enter_scope();
+
+    for (size_t i = 0; i < parameters.size(); i++) {
+        auto symbol = declare_variable(parameters[i]);
+        stream << "\tstr x" << (int) i << ", [sp, " << symbol.memory_location << "]\n";
+
+        if (i == 0) {
+            x0_variable = symbol.memory_location;
+        }
+    }
+
+    for (size_t i = 0; i < body.size(); i++) {
+        Node statement = body[i];
+
+        // a trailing return falls through into the epilogue on its own
+        if (i + 1 == body.size() && statement.type() == NodeType::Return && !statement.empty()) {
+            generate_code(statement[0], stream);
+        } else {
+            generate_code(statement, stream);
+        }
+    }
+
+    exit_scope();
+    current_function = { nullptr, 0 };
+
+    stream << "_fn_" << node.value() << "_return:\n";
+    adjust_stack_pointer("add", frame, stream);
+    if (!leaf) {
+        stream << "\tldp x29, x30, [sp], 16\n";
+    }
+    stream << "\tret\n";
+
+    flush_cold_code(stream);
+}
+
+// a run of top level statements generated on its own, with everything it
+// would have inherited from the statements before it filled in up front
+struct Chunk {
+    uint32_t first;
+    uint32_t last;
+
+    std::unordered_map<std::string, Symbol> globals;
+    int offset;
+    int x0;
+
+    // labels and pool entries are handed out from ranges big enough for
+    // anything the chunk's nodes could need. ifs are counted exactly, their
+    // numbers are what profiles refer to
+    int first_label;
+    int last_label;
+    int first_branch;
+    int first_literal;
+    int first_string;
+
+    Emitter code;
+    std::vector<std::unique_ptr<Emitter>> cold;
+    std::vector<int64_t> literals;
+    std::vector<std::string> strings;
+    int end_label;
+    int end_branch;
+
+    // the first error in the chunk, generation stopped after its statement
+    std::string error;
+};
+
+// small programs stay in one chunk, which generates exactly what walking the
+// root did before
+int chunk_nodes = 16 * 1024;
+
+// what a top level statement could take from the label, branch and pool
+// counters. an if or while takes one label, && and || at most two
+struct ChunkCosts {
+    int nodes = 0;
+    int labels = 0;
+    int branches = 0;
+    int literals = 0;
+    int strings = 0;
+};
+
+void measure_chunk_costs(Node node, ChunkCosts& costs)
+{
+    costs.nodes++;
+
+    switch (node.type()) {
+        case NodeType::If:
+            costs.labels++;
+            costs.branches++;
+            break;
+        case NodeType::While:
+            costs.labels++;
+            break;
+        case NodeType::LogicalOperator:
+            costs.labels += 2;
+            break;
+        case NodeType::Number:
+            costs.literals++;
+            break;
+        case NodeType::String:
+            costs.strings++;
+            break;
+        default:
             break;
+    }
+
+    for (Node child : node) {
+        measure_chunk_costs(child, costs);
+    }
+}
+
+// splits the root's statements into chunks. a chunk can only start where the
+// generator's state is known without generating what comes before, which is
+// after an assignment (x0 holds the variable) or after an if, call or #asm
+// (x0 holds nothing known)
+std::vector<std::unique_ptr<Chunk>> plan_chunks(Node root)
+{
+    std::vector<std::unique_ptr<Chunk>> chunks;
+
+    std::unordered_map<std::string, Symbol> globals;
+    int offset = 0;
+    int x0 = -1;
+    bool can_split = true;
+    ChunkCosts total;
+    ChunkCosts current;
+
+    for (uint32_t i = 0; i < root.size(); i++) {
+        Node statement = root[i];
+
+        // generated later, and leaves everything as it was
+        if (statement.type() == NodeType::Function) {
+            continue;
+        }
+
+        if (chunks.empty() || (current.nodes >= chunk_nodes && can_split)) {
+            if (!chunks.empty()) {
+                chunks.back()->last = i;
+                chunks.back()->last_label = total.labels;
+            }
+
+            chunks.emplace_back(new Chunk());
+            Chunk& chunk = *chunks.back();
+
+            chunk.first = i;
+            chunk.globals = globals;
+            chunk.offset = offset;
+            chunk.x0 = x0;
+            chunk.first_label = total.labels;
+            chunk.first_branch = total.branches;
+            chunk.first_literal = total.literals;
+            chunk.first_string = total.strings;
+
+            current = ChunkCosts();
+        }
+
+        ChunkCosts costs;
+        measure_chunk_costs(statement, costs);
+
+        current.nodes += costs.nodes;
+        total.labels += costs.labels;
+        total.branches += costs.branches;
+        total.literals += costs.literals;
+        total.strings += costs.strings;
+
+        // the same declarations assign_variable makes at the top level
+        if (statement.type() == NodeType::Assignment) {
+            auto symbol = globals.find(statement.value().str());
+            if (symbol == globals.end()) {
+                symbol = globals.insert({ statement.value().str(), { statement.value().str(), offset } }).first;
+                offset += 8;
+            }
+
+            x0 = symbol->second.memory_location;
+            can_split = true;
+        } else {
+            x0 = -1;
+            can_split = statement.type() == NodeType::If || statement.type() == NodeType::Call || statement.type() == NodeType::Directive;
+        }
+    }
+
+    if (!chunks.empty()) {
+        chunks.back()->last = root.size();
+        chunks.back()->last_label = total.labels;
+    }
+
+    return chunks;
+}
+
+void generate_chunk(Node root, Chunk& chunk)
+{
+    pointer = 0;
+    current_offset = chunk.offset;
+    x0_variable = chunk.x0;
+    jump_index = chunk.first_label;
+    branch_index = chunk.first_branch;
+    current_function = { nullptr, 0 };
+    cold_code.clear();
+
+    st_stack.clear();
+    st_stack.push_back(chunk.globals);
+
+    literal_pool.clear();
+    literal_pool_values.clear();
+    literal_base = chunk.first_literal;
+    string_pool.clear();
+    string_pool_values.clear();
+    string_base = chunk.first_string;
+    generate_error.clear();
+
+    for (uint32_t i = chunk.first; i < chunk.last && generate_error.empty(); i++) {
+        // functions are generated after _main, see generate()
+        if (root[i].type() != NodeType::Function) {
+            generate_code(root[i], chunk.code);
         }
     }
+
+    if (jump_index > chunk.last_label) {
+        report_error("Chunk used labels past its range, cannot continue.");
+    }
+
+    chunk.error = generate_error;
+
+    chunk.end_label = jump_index;
+    chunk.end_branch = branch_index;
+    chunk.cold = std::move(cold_code);
+    chunk.literals = literal_pool_values;
+    for (const std::string* string : string_pool_values) {
+        chunk.strings.push_back(*string);
+    }
 }
 
+void generate(const FlatAST& ast, Emitter& stream, bool instrumented, const Profile* profile, int threads) {
+    Node node = ast.root();
+
+    instrument = instrumented;
+    branch_profile = profile;
+
+    generate_error.clear();
+    functions.clear();
+    for (Node child : node) {
+        if (child.type() != NodeType::Function) {
+            continue;
+        }
+
+        if (!functions.insert({ child.value().str(), child }).second) {
+            report_error("Function '" + child.value().str() + "' is declared more than once.");
+        }
+    }
+
+    stop_on_error(generate_error);
+
+    adjust_stack_pointer("sub", frame_size(node, {}), stream);
+
+    // chunks don't depend on the thread count, so neither does the output
+    std::vector<std::unique_ptr<Chunk>> chunks = plan_chunks(node);
+
+    if (threads > (int) chunks.size()) {
+        threads = chunks.size();
+    }
+
+    if (threads <= 1) {
+        for (const auto& chunk : chunks) {
+            generate_chunk(node, *chunk);
+
+            if (!chunk->error.empty()) {
+                break;
+            }
+        }
+    } else {
+        std::atomic<size_t> next(0);
+        std::atomic<bool> failed(false);
+        std::vector<std::thread> workers;
+
+        // chunks are handed out in order, so once one fails every chunk
+        // before it has been started and still finishes
+        for (int i = 0; i < threads; i++) {
+            workers.emplace_back([&]() {
+                for (size_t chunk = next++; chunk < chunks.size() && !failed; chunk = next++) {
+                    generate_chunk(node, *chunks[chunk]);
+
+                    if (!chunks[chunk]->error.empty()) {
+                        failed = true;
+                    }
+                }
+            });
+        }
+
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    // the error the program would have stopped at without chunks
+    for (const auto& chunk : chunks) {
+        stop_on_error(chunk->error);
+    }
 
-void generate(const std::shared_ptr<ASTNode>& node, std::stringstream& stream) {
+    for (const auto& chunk : chunks) {
+        stream.append(chunk->code);
+    }
+    for (const auto& chunk : chunks) {
+        for (const auto& cold : chunk->cold) {
+            stream.append(*cold);
+        }
+    }
+
+    // functions carry on from where the last chunk left off, so a program
+    // that fits in one chunk numbers everything as if there were no chunks
     pointer = 0;
-    jump_index = 0;
+    current_offset = 0;
+    x0_variable = -1;
+    current_function = { nullptr, 0 };
+    cold_code.clear();
+    st_stack.clear();
+
+    literal_pool.clear();
+    literal_pool_values.clear();
+    string_pool.clear();
+    string_pool_values.clear();
 
-    std::unordered_map<std::string, Symbol> global_scope;
+    std::vector<std::pair<int, int64_t>> literals;
+    std::vector<std::pair<int, const std::string*>> strings;
 
-    st_stack.push_back(global_scope);
+    if (chunks.empty()) {
+        jump_index = 0;
+        branch_index = 0;
+        literal_base = 0;
+        string_base = 0;
+    } else {
+        const Chunk& last = *chunks.back();
+
+        jump_index = last.end_label;
+        branch_index = last.end_branch;
+
+        for (size_t i = 0; i + 1 < chunks.size(); i++) {
+            for (size_t j = 0; j < chunks[i]->literals.size(); j++) {
+                literals.push_back({ chunks[i]->first_literal + (int) j, chunks[i]->literals[j] });
+            }
+            for (size_t j = 0; j < chunks[i]->strings.size(); j++) {
+                strings.push_back({ chunks[i]->first_string + (int) j, &chunks[i]->strings[j] });
+            }
+        }
+
+        literal_base = last.first_literal;
+        for (int64_t value : last.literals) {
+            literal_pool[value] = literal_base + literal_pool_values.size();
+            literal_pool_values.push_back(value);
+        }
+
+        string_base = last.first_string;
+        for (const std::string& value : last.strings) {
+            intern_string(value);
+        }
+    }
+
+    generate_error.clear();
+
+    for (Node child : node) {
+        if (child.type() == NodeType::Function) {
+            generate_function(child, stream);
+        }
+    }
+
+    stop_on_error(generate_error);
+
+    if (instrument) {
+        generate_profile_support(program_hash(ast), stream);
+    }
+
+    for (size_t i = 0; i < literal_pool_values.size(); i++) {
+        literals.push_back({ literal_base + (int) i, literal_pool_values[i] });
+    }
+    for (size_t i = 0; i < string_pool_values.size(); i++) {
+        strings.push_back({ string_base + (int) i, string_pool_values[i] });
+    }
 
-    generate_code(node, stream);
+    generate_literal_pool(literals, stream);
+    generate_string_pool(strings, stream);
 }
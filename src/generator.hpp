@@ -1,13 +1,24 @@
 #ifndef GENERATOR_HPP
 #define GENERATOR_HPP
 
-#include "parser.hpp"
+#include "emitter.hpp"
+#include "flat_ast.hpp"
+#include "profile.hpp"
 
 struct Symbol {
     std::string name;
     int memory_location;
 };
 
-void generate(const std::shared_ptr<ASTNode>& node, std::stringstream& stream);
+// how many nodes of top level statements go into a chunk before the next
+// one starts
+extern int chunk_nodes;
+
+// walks the flattened tree, which may be a file mapped straight from disk.
+// instrumented code counts how its ifs go and writes a profile on exit, a
+// profile from such a run lays the ifs out for the arms that ran most. the
+// top level statements are split into chunks that are generated on up to
+// threads threads, the output is the same for any number of them
+void generate(const FlatAST& ast, Emitter& stream, bool instrumented = false, const Profile* profile = nullptr, int threads = 1);
 
 #endif
@@ -0,0 +1,376 @@
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+
+#include "incremental.hpp"
+
+// the tokens an edit replaced: the old tokens [first, old_end) became the new
+// tokens [first, new_end), the ones before and after were kept as they were
+struct TokenDamage {
+    int first;
+    int old_end;
+    int new_end;
+};
+
+long long microseconds_since(std::chrono::high_resolution_clock::time_point start)
+{
+    auto elapsed = std::chrono::high_resolution_clock::now() - start;
+    return std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+}
+
+// replaces [first, last) of values with replacement, moving the tail at most
+// once
+template <typename T>
+void splice(std::vector<T>& values, int first, int last, std::vector<T>& replacement)
+{
+    int common = std::min(last - first, (int) replacement.size());
+
+    for (int i = 0; i < common; i++) {
+        values[first + i] = std::move(replacement[i]);
+    }
+
+    if (common < last - first) {
+        values.erase(values.begin() + first + common, values.begin() + last);
+    } else {
+        values.insert(values.begin() + last, std::make_move_iterator(replacement.begin() + common), std::make_move_iterator(replacement.end()));
+    }
+}
+
+// lexes and parses all of contents, the tree is only replaced if it parses
+bool rebuild(Document& document, EditTiming& timing)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+
+    document.tokens.clear();
+    document.token_ends.clear();
+    lexer_error.clear();
+
+    LexerState state;
+    bool more = true;
+
+    while (more) {
+        more = next_token(document.contents, state, document.tokens);
+        document.token_ends.push_back(state);
+    }
+
+    timing.tokens_lexed = (int) document.tokens.size();
+    timing.lex_microseconds = microseconds_since(start);
+
+    if (!lexer_error.empty()) {
+        document.error = lexer_error;
+        return false;
+    }
+
+    start = std::chrono::high_resolution_clock::now();
+    std::shared_ptr<ASTNode> root = parse(&document.tokens);
+    timing.parse_microseconds = microseconds_since(start);
+
+    if (!parser_error.empty()) {
+        document.error = parser_error;
+        return false;
+    }
+
+    timing.statements_parsed = (int) root->children.size();
+    document.root = root;
+    document.error.clear();
+
+    return true;
+}
+
+bool open_document(Document& document, const std::string& contents)
+{
+    document.contents = contents;
+    document.root = std::make_shared<ASTNode>(NodeType::Root, "");
+
+    EditTiming timing;
+    return rebuild(document, timing);
+}
+
+TokenDamage relex(Document& document, const Edit& edit, EditTiming& timing)
+{
+    std::vector<Token>& tokens = document.tokens;
+    std::vector<LexerState>& ends = document.token_ends;
+
+    int delta = (int) edit.inserted.size() - edit.removed;
+    int edit_end = edit.offset + (int) edit.inserted.size();
+
+    // the lexer looks one character past a token at most, so every token that
+    // ends before the edit comes out the same. the EOF token never does
+    auto first_damaged = std::lower_bound(ends.begin(), ends.end() - 1, edit.offset, [](const LexerState& end, int offset) {
+        return end.offset < offset;
+    });
+    int kept = (int) (first_damaged - ends.begin());
+
+    LexerState state = kept > 0 ? ends[kept - 1] : LexerState();
+
+    std::vector<Token> lexed;
+    std::vector<LexerState> lexed_ends;
+    int reused = (int) tokens.size();
+    int candidate = kept;
+
+    while (next_token(document.contents, state, lexed)) {
+        lexed_ends.push_back(state);
+
+        if (state.offset < edit_end) {
+            continue;
+        }
+
+        // everything from here on is the old source, so once the lexer stands
+        // where it stood after an old token it would only lex the same tokens
+        // again
+        int old_offset = state.offset - delta;
+        while (candidate + 1 < (int) ends.size() && ends[candidate].offset < old_offset) {
+            candidate++;
+        }
+
+        if (candidate + 1 < (int) ends.size() && ends[candidate].offset == old_offset) {
+            reused = candidate + 1;
+            break;
+        }
+    }
+
+    if (reused == (int) tokens.size()) {
+        // ran into the end, the EOF token was lexed again as well
+        lexed_ends.push_back(state);
+    } else {
+        // the kept tokens move by the size of the edit, and the ones still on
+        // the line the lexer resynchronised on move sideways as well
+        int line_shift = state.line - ends[reused - 1].line;
+        int character_shift = state.character - ends[reused - 1].character;
+        int resync_line = ends[reused - 1].line;
+
+        if (delta != 0 || line_shift != 0 || character_shift != 0) {
+            for (int i = reused; i < (int) tokens.size(); i++) {
+                if (tokens[i].line == resync_line) {
+                    tokens[i].character += character_shift;
+                }
+                tokens[i].line += line_shift;
+
+                if (ends[i].line == resync_line) {
+                    ends[i].character += character_shift;
+                }
+                ends[i].line += line_shift;
+                ends[i].offset += delta;
+            }
+        }
+    }
+
+    timing.tokens_lexed = (int) lexed.size();
+    timing.tokens_reused = (int) tokens.size() - (reused - kept);
+
+    TokenDamage damage;
+    damage.first = kept;
+    damage.old_end = reused;
+    damage.new_end = kept + (int) lexed.size();
+
+    splice(tokens, kept, reused, lexed);
+    splice(ends, kept, reused, lexed_ends);
+
+    return damage;
+}
+
+std::shared_ptr<ASTNode> reparse_statements(Document& document, const TokenDamage& damage, const std::shared_ptr<ASTNode>& list, int first, int close, EditTiming& timing);
+
+// a copy of statement, which starts at old token start, with the block the
+// damage is inside of parsed again. nullptr if the damage isn't inside one
+// of its blocks or the block now ends somewhere else
+std::shared_ptr<ASTNode> reparse_inside(Document& document, const TokenDamage& damage, const std::shared_ptr<ASTNode>& statement, int start, EditTiming& timing)
+{
+    int end = start + statement->tokens;
+
+    // the blocks always come last, so they're found from the end
+    std::shared_ptr<ASTNode> block;
+    int open = 0;
+    bool in_else = false;
+
+    if (statement->type == NodeType::While || statement->type == NodeType::Function) {
+        block = statement->children.back();
+        open = end - block->tokens;
+    } else if (statement->type == NodeType::If) {
+        block = statement->children[1];
+        open = end - block->tokens;
+
+        if (statement->children.size() == 3) {
+            const std::shared_ptr<ASTNode>& else_block = statement->children[2]->children[0];
+            int else_open = end - else_block->tokens;
+
+            if (else_open < damage.first) {
+                block = else_block;
+                open = else_open;
+                in_else = true;
+            } else {
+                // skip the else keyword
+                open = else_open - 1 - block->tokens;
+            }
+        }
+    } else {
+        return nullptr;
+    }
+
+    int close = open + block->tokens - 1;
+    if (open >= damage.first || damage.old_end > close) {
+        return nullptr;
+    }
+
+    std::shared_ptr<ASTNode> parsed = reparse_statements(document, damage, block, open + 1, close, timing);
+    if (parsed == nullptr) {
+        return nullptr;
+    }
+
+    std::shared_ptr<ASTNode> copy = std::make_shared<ASTNode>(*statement);
+    copy->tokens += damage.new_end - damage.old_end;
+
+    if (in_else) {
+        std::shared_ptr<ASTNode> else_node = std::make_shared<ASTNode>(*statement->children[2]);
+        else_node->children[0] = parsed;
+        copy->children[2] = else_node;
+    } else if (statement->type == NodeType::If) {
+        copy->children[1] = parsed;
+    } else {
+        copy->children.back() = parsed;
+    }
+
+    return copy;
+}
+
+// the root's or a block's statements parsed again from the first one that saw
+// a changed token, until the parser is back in step with the old statements.
+// first is the old index of the first statement's token and close the old
+// index of the closing brace, or of EOF for the root. a block that doesn't
+// close on the same brace any more gives nullptr, its enclosing statement has
+// to be parsed again instead
+std::shared_ptr<ASTNode> reparse_statements(Document& document, const TokenDamage& damage, const std::shared_ptr<ASTNode>& list, int first, int close, EditTiming& timing)
+{
+    const std::vector<std::shared_ptr<ASTNode>>& children = list->children;
+    bool is_root = list->type == NodeType::Root;
+    int delta = damage.new_end - damage.old_end;
+
+    std::vector<int> starts;
+    starts.reserve(children.size());
+
+    int start = first;
+    for (const auto& child : children) {
+        starts.push_back(start);
+        start += child->tokens;
+    }
+
+    // a statement looks at the token after it to see that it's over, so it's
+    // only untouched if that one is too
+    size_t dirty = 0;
+    while (dirty < children.size() && starts[dirty] + children[dirty]->tokens < damage.first) {
+        dirty++;
+    }
+
+    std::shared_ptr<ASTNode> copy = std::make_shared<ASTNode>(list->type, list->value);
+    if (!is_root) {
+        copy->tokens = list->tokens + delta;
+    }
+
+    if (dirty < children.size()) {
+        int reused = timing.statements_reused;
+        std::shared_ptr<ASTNode> statement = reparse_inside(document, damage, children[dirty], starts[dirty], timing);
+
+        // the tree is thrown away after a syntax error
+        if (!parser_error.empty()) {
+            return copy;
+        }
+
+        if (statement != nullptr) {
+            copy->children = children;
+            copy->children[dirty] = statement;
+            timing.statements_reused += (int) children.size() - 1;
+
+            return copy;
+        }
+
+        timing.statements_reused = reused;
+    }
+
+    copy->children.assign(children.begin(), children.begin() + dirty);
+    timing.statements_reused += (int) dirty;
+
+    // statements before the damage start at the same token in the old and
+    // the new tokens
+    int position = dirty < children.size() ? starts[dirty] : first;
+    size_t next_old = dirty;
+
+    while (true) {
+        TokenType type = document.tokens[position].type;
+
+        if (is_root ? type == TokenType::_EOF : type == TokenType::RIGHT_BRACE) {
+            if (!is_root && (position < damage.new_end || position - delta != close)) {
+                return nullptr;
+            }
+            break;
+        }
+
+        if (position >= damage.new_end) {
+            int old_position = position - delta;
+
+            while (next_old < children.size() && starts[next_old] < old_position) {
+                next_old++;
+            }
+
+            if (next_old < children.size() && starts[next_old] == old_position) {
+                copy->children.insert(copy->children.end(), children.begin() + next_old, children.end());
+                timing.statements_reused += (int) (children.size() - next_old);
+                break;
+            }
+
+            // the old closing brace went into a statement
+            if (!is_root && old_position > close) {
+                return nullptr;
+            }
+        }
+
+        copy->children.push_back(parse_statement_at(&document.tokens, position, position));
+        timing.statements_parsed++;
+
+        if (!parser_error.empty()) {
+            break;
+        }
+    }
+
+    return copy;
+}
+
+EditResult apply_edit(Document& document, const Edit& edit, EditTiming& timing)
+{
+    timing = EditTiming();
+
+    if (edit.offset < 0 || edit.removed < 0 || edit.offset > (int) document.contents.size() || edit.removed > (int) document.contents.size() - edit.offset) {
+        return EditOutOfRange;
+    }
+
+    document.contents.replace(edit.offset, edit.removed, edit.inserted);
+
+    // the tokens and the tree can't be patched, they're from before the
+    // source broke
+    if (!document.error.empty()) {
+        return rebuild(document, timing) ? EditApplied : EditDamaged;
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    lexer_error.clear();
+    TokenDamage damage = relex(document, edit, timing);
+    timing.lex_microseconds = microseconds_since(start);
+
+    if (!lexer_error.empty()) {
+        document.error = lexer_error;
+        return EditDamaged;
+    }
+
+    start = std::chrono::high_resolution_clock::now();
+    parser_error.clear();
+    int old_eof = (int) document.tokens.size() - 1 - (damage.new_end - damage.old_end);
+    std::shared_ptr<ASTNode> root = reparse_statements(document, damage, document.root, 0, old_eof, timing);
+    timing.parse_microseconds = microseconds_since(start);
+
+    if (!parser_error.empty()) {
+        document.error = parser_error;
+        return EditDamaged;
+    }
+
+    document.root = root;
+    return EditApplied;
+}
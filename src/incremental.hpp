@@ -0,0 +1,67 @@
+#ifndef INCREMENTAL_HPP
+#define INCREMENTAL_HPP
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "lexer.hpp"
+#include "parser.hpp"
+
+// the bytes [offset, offset + removed) of the source replaced by inserted
+struct Edit {
+    int offset;
+    int removed;
+    std::string inserted;
+};
+
+// what one edit cost and how much of the previous tokens and tree it kept
+struct EditTiming {
+    long long lex_microseconds = 0;
+    long long parse_microseconds = 0;
+
+    int tokens_lexed = 0;
+    int tokens_reused = 0;
+    int statements_parsed = 0;
+    int statements_reused = 0;
+};
+
+// a source file with its tokens and tree, kept up to date one edit at a time.
+// the tree shares every subtree an edit didn't touch with the tree before it,
+// so it has to be copied before anything changes it in place, e.g. optimize
+struct Document {
+    std::string contents;
+    std::vector<Token> tokens;
+
+    // the lexer state right after each token, lexing can pick up from any of
+    // them
+    std::vector<LexerState> token_ends;
+
+    std::shared_ptr<ASTNode> root;
+
+    // why contents doesn't lex or parse, empty if it does. while it isn't,
+    // the tree is the last one that parsed, the tokens may not match contents
+    // and the next edit lexes and parses the whole source again
+    std::string error;
+};
+
+enum EditResult : uint8_t {
+    EditApplied,
+
+    // the edit reaches outside the source, nothing was changed
+    EditOutOfRange,
+
+    // the edit was made, but the source doesn't lex or parse any more, see
+    // Document::error
+    EditDamaged,
+};
+
+// returns false if contents doesn't lex or parse, see Document::error
+bool open_document(Document& document, const std::string& contents);
+
+// applies edit to the source and brings the tokens and the tree up to date.
+// only the tokens around the edit are lexed again and only the innermost
+// statements that contain it are parsed again
+EditResult apply_edit(Document& document, const Edit& edit, EditTiming& timing);
+
+#endif
@@ -1,5 +1,7 @@
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <string>
 #include <vector>
 
 #include "lexer.hpp"
@@ -23,6 +25,12 @@ const char* print_token_type(TokenType token_type)
             return "'if'";
         case TokenType::ELSE:
             return "'else'";
+        case TokenType::WHILE:
+            return "'while'";
+        case TokenType::FN:
+            return "'fn'";
+        case TokenType::RETURN:
+            return "'return'";
         case TokenType::OPERATOR_PLUS:
             return "'+'";
         case TokenType::OPERATOR_MINUS:
@@ -43,6 +51,10 @@ const char* print_token_type(TokenType token_type)
             return "'>='";
         case TokenType::CONDITION_OPERATOR_LTE:
             return "'<='";
+        case TokenType::LOGICAL_AND:
+            return "'&&'";
+        case TokenType::LOGICAL_OR:
+            return "'||'";
         case TokenType::LEFT_PAREN:
             return "'('";
         case TokenType::RIGHT_PAREN:
@@ -51,6 +63,8 @@ const char* print_token_type(TokenType token_type)
             return "'{'";
         case TokenType::RIGHT_BRACE:
             return "'}'";
+        case TokenType::COMMA:
+            return "','";
         case TokenType::ASM:
             return "'#asm'";
         case TokenType::_EOF:
@@ -58,295 +72,429 @@ const char* print_token_type(TokenType token_type)
     }
 }
 
-std::vector<Token> tokenize(const std::string& contents)
+std::string lexer_error;
+
+void lex_error(const std::string& message)
 {
-    std::vector<Token> tokens;
+    if (lexer_error.empty()) {
+        lexer_error = message;
+    }
+}
 
-    int line_count = 1;
-    int character_count = 1;
-    std::string buffer;
+// the character at i, or NUL past the end of contents, which nothing matches
+char char_at(const std::string& contents, int i)
+{
+    return i < (int) contents.length() ? contents[i] : '\0';
+}
+
+// lexes whatever starts at state.offset, at most one token. the offset is
+// left on the last character that was looked at, the caller steps past it
+void scan(const std::string& contents, LexerState& state, std::string& buffer, std::vector<Token>& tokens)
+{
+    int& i = state.offset;
+    int& line_count = state.line;
+    int& character_count = state.character;
+
+    char current_char = char_at(contents, i);
 
-    for (int i = 0; i < contents.length(); i++) {
-        char current_char = contents.at(i);
+    if (std::isalpha(current_char) != 0) {
+        buffer.push_back(current_char);
 
-        if (std::isalpha(current_char) != 0) {
-            buffer.push_back(current_char);
+        i++;
+        character_count++;
 
+        while (std::isalnum(char_at(contents, i)) != 0) {
+            buffer.push_back(char_at(contents, i));
             i++;
             character_count++;
+        }
 
-            while (std::isalnum(contents.at(i)) != 0) {
-                buffer.push_back(contents.at(i));
-                i++;
-                character_count++;
-            }
+        i--;
+        character_count--;
 
-            i--;
-            character_count--;
+        if (buffer == "true" || buffer == "false") {
+            Token token;
+            token.type = TokenType::BOOLEAN;
+            token.value = buffer;
+            token.line = line_count;
+            token.character = character_count - buffer.length() + 1;
+            tokens.push_back(token);
+            buffer.clear();
+            return;
+        }
 
-            if (buffer == "true" || buffer == "false") {
-                Token token;
-                token.type = TokenType::BOOLEAN;
-                token.value = buffer;
-                token.line = line_count;
-                token.character = character_count - buffer.length() + 1;
-                tokens.push_back(token);
-                buffer.clear();
-                continue;
-            }
+        if (buffer == "if") {
+            Token token;
+            token.type = TokenType::IF;
+            token.line = line_count;
+            token.character = character_count - buffer.length() + 1;
+            tokens.push_back(token);
+            buffer.clear();
+            return;
+        }
 
-            if (buffer == "if") {
-                Token token;
-                token.type = TokenType::IF;
-                token.line = line_count;
-                token.character = character_count - buffer.length() + 1;
-                tokens.push_back(token);
-                buffer.clear();
-                continue;
-            }
+        if (buffer == "else") {
+            Token token;
+            token.type = TokenType::ELSE;
+            token.line = line_count;
+            token.character = character_count - buffer.length() + 1;
+            tokens.push_back(token);
+            buffer.clear();
+            return;
+        }
 
-            if (buffer == "else") {
-                Token token;
-                token.type = TokenType::ELSE;
-                token.line = line_count;
-                token.character = character_count - buffer.length() + 1;
-                tokens.push_back(token);
-                buffer.clear();
-                continue;
-            }
+        if (buffer == "while") {
+            Token token;
+            token.type = TokenType::WHILE;
+            token.line = line_count;
+            token.character = character_count - buffer.length() + 1;
+            tokens.push_back(token);
+            buffer.clear();
+            return;
+        }
 
+        if (buffer == "fn") {
             Token token;
-            token.type = TokenType::IDENTIFIER;
-            token.value = buffer;
+            token.type = TokenType::FN;
             token.line = line_count;
             token.character = character_count - buffer.length() + 1;
             tokens.push_back(token);
             buffer.clear();
-        } else if (std::isdigit(current_char) != 0) {
-            buffer.push_back(current_char);
+            return;
+        }
+
+        if (buffer == "return") {
+            Token token;
+            token.type = TokenType::RETURN;
+            token.line = line_count;
+            token.character = character_count - buffer.length() + 1;
+            tokens.push_back(token);
+            buffer.clear();
+            return;
+        }
+
+        Token token;
+        token.type = TokenType::IDENTIFIER;
+        token.value = buffer;
+        token.line = line_count;
+        token.character = character_count - buffer.length() + 1;
+        tokens.push_back(token);
+        buffer.clear();
+    } else if (std::isdigit(current_char) != 0) {
+        buffer.push_back(current_char);
+        i++;
+        character_count++;
+
+        while (std::isdigit(char_at(contents, i)) != 0) {
+            buffer.push_back(char_at(contents, i));
             i++;
             character_count++;
+        }
+
+        i--;
+        character_count--;
 
-            while (std::isdigit(contents.at(i)) != 0) {
-                buffer.push_back(contents.at(i));
+        // parse the digits once here so nothing later has to look at the text again
+        int64_t number = 0;
+        for (char digit : buffer) {
+            if (number > (INT64_MAX - (digit - '0')) / 10) {
+                lex_error("\n\x1b[31m[error 2]\033[0m: integer literal " + buffer + " does not fit in 64 bits.\n"
+                    + "\t-> " + std::to_string(line_count) + ":" + std::to_string((int) (character_count - buffer.length() + 1)) + "\n");
+                break;
+            }
+
+            number = number * 10 + (digit - '0');
+        }
+
+        Token token;
+        token.type = TokenType::INT_LIT;
+        token.value = buffer;
+        token.number = number;
+        token.line = line_count;
+        token.character = character_count - buffer.length() + 1;
+        tokens.push_back(token);
+        buffer.clear();
+    } else if (current_char == '+') {
+        Token token;
+        token.type = TokenType::OPERATOR_PLUS;
+        token.line = line_count;
+        token.character = character_count;
+        tokens.push_back(token);
+    } else if (current_char == '-') {
+        Token token;
+        token.type = TokenType::OPERATOR_MINUS;
+        token.line = line_count;
+        token.character = character_count;
+        tokens.push_back(token);
+    } else if (current_char == '*') {
+        Token token;
+        token.type = TokenType::OPERATOR_STAR;
+        token.line = line_count;
+        token.character = character_count;
+        tokens.push_back(token);
+    } else if (current_char == '/') {
+        i++;
+        character_count++;
+
+        if (char_at(contents, i) == '/') {
+            while (i < (int) contents.length() && contents[i] != '\n') {
                 i++;
                 character_count++;
             }
 
-            i--;
-            character_count--;
+            // a comment on the last line ends with the source
+            if (i == (int) contents.length()) {
+                i--;
+                character_count--;
+            }
+            return;
+        }
 
+        i--;
+        character_count--;
+
+        Token token;
+        token.type = TokenType::OPERATOR_SLASH;
+        token.line = line_count;
+        token.character = character_count;
+        tokens.push_back(token);
+    } else if (current_char == '(') {
+        Token token;
+        token.type = TokenType::LEFT_PAREN;
+        token.line = line_count;
+        token.character = character_count;
+        tokens.push_back(token);
+    } else if (current_char == ')') {
+        Token token;
+        token.type = TokenType::RIGHT_PAREN;
+        token.line = line_count;
+        token.character = character_count;
+        tokens.push_back(token);
+    } else if (current_char == ',') {
+        Token token;
+        token.type = TokenType::COMMA;
+        token.line = line_count;
+        token.character = character_count;
+        tokens.push_back(token);
+    } else if (current_char == '{') {
+        Token token;
+        token.type = TokenType::LEFT_BRACE;
+        token.line = line_count;
+        token.character = character_count;
+        tokens.push_back(token);
+    } else if (current_char == '}') {
+        Token token;
+        token.type = TokenType::RIGHT_BRACE;
+        token.line = line_count;
+        token.character = character_count;
+        tokens.push_back(token);
+    } else if (current_char == '=') {
+        i++;
+        character_count++;
+
+        if (char_at(contents, i) == '=') {
             Token token;
-            token.type = TokenType::INT_LIT;
-            token.value = buffer;
-            token.line = line_count;
-            token.character = character_count - buffer.length() + 1;
-            tokens.push_back(token);
-            buffer.clear();
-        } else if (current_char == '+') {
-            Token token;
-            token.type = TokenType::OPERATOR_PLUS;
+            token.type = TokenType::CONDITION_OPERATOR_EQ;
             token.line = line_count;
             token.character = character_count;
             tokens.push_back(token);
-        } else if (current_char == '-') {
+        } else if (std::isspace(char_at(contents, i)) != 0) {
             Token token;
-            token.type = TokenType::OPERATOR_MINUS;
+            token.type = TokenType::ASSIGNMENT;
             token.line = line_count;
             token.character = character_count;
             tokens.push_back(token);
-        } else if (current_char == '*') {
+        } else {
+            i--;
+            character_count++;
+        }
+    } else if (current_char == '!') {
+        i++;
+        character_count++;
+
+        if (char_at(contents, i) == '=') {
             Token token;
-            token.type = TokenType::OPERATOR_STAR;
+            token.type = TokenType::CONDITION_OPERATOR_NE;
             token.line = line_count;
             token.character = character_count;
             tokens.push_back(token);
-        } else if (current_char == '/') {
-            i++;
-            character_count++;
-
-            if (contents.at(i) == '/') {
-                while (contents.at(i) != '\n') {
-                    i++;
-                    character_count++;
-                }
-                continue;
-            }
-
+        } else if (std::isalnum(char_at(contents, i)) != 0 || char_at(contents, i) == '(' || char_at(contents, i) == '!') {
+            // the operand is lexed on its own next time around
             i--;
             character_count--;
 
             Token token;
-            token.type = TokenType::OPERATOR_SLASH;
+            token.type = TokenType::BANG;
             token.line = line_count;
             token.character = character_count;
             tokens.push_back(token);
-        } else if (current_char == '(') {
+        } else {
+            // @todo check me for correctness
+            lex_error("Invalid character following '!'.");
+            i--;
+            character_count--;
+        }
+    } else if (current_char == '&' || current_char == '|') {
+        i++;
+        character_count++;
+
+        if (char_at(contents, i) != current_char) {
+            lex_error(std::string("Invalid character following '") + current_char + "', did you mean '" + current_char + current_char + "'?");
+            i--;
+            character_count--;
+            return;
+        }
+
+        Token token;
+        token.type = current_char == '&' ? TokenType::LOGICAL_AND : TokenType::LOGICAL_OR;
+        token.line = line_count;
+        token.character = character_count - 1;
+        tokens.push_back(token);
+    } else if (current_char == '>') {
+        i++;
+        character_count++;
+
+        if (char_at(contents, i) == '=') {
             Token token;
-            token.type = TokenType::LEFT_PAREN;
+            token.type = TokenType::CONDITION_OPERATOR_GTE;
             token.line = line_count;
             token.character = character_count;
             tokens.push_back(token);
-        } else if (current_char == ')') {
+        } else if (std::isalnum(char_at(contents, i)) != 0 || (std::isspace(char_at(contents, i)) != 0)) {
             Token token;
-            token.type = TokenType::RIGHT_PAREN;
+            token.type = TokenType::CONDITION_OPERATOR_GT;
             token.line = line_count;
             token.character = character_count;
             tokens.push_back(token);
-        } else if (current_char == '{') {
+        } else {
+            // @todo check me for correctness
+            i--;
+            character_count--;
+        }
+    } else if (current_char == '<') {
+        i++;
+        character_count++;
+
+        if (char_at(contents, i) == '=') {
             Token token;
-            token.type = TokenType::LEFT_BRACE;
+            token.type = TokenType::CONDITION_OPERATOR_LTE;
             token.line = line_count;
             token.character = character_count;
             tokens.push_back(token);
-        } else if (current_char == '}') {
+        } else if (std::isalnum(char_at(contents, i)) != 0 || (std::isspace(char_at(contents, i)) != 0)) {
             Token token;
-            token.type = TokenType::RIGHT_BRACE;
+            token.type = TokenType::CONDITION_OPERATOR_LT;
             token.line = line_count;
             token.character = character_count;
             tokens.push_back(token);
-        } else if (current_char == '=') {
-            i++;
-            character_count++;
-
-            if (contents.at(i) == '=') {
-                Token token;
-                token.type = TokenType::CONDITION_OPERATOR_EQ;
-                token.line = line_count;
-                token.character = character_count;
-                tokens.push_back(token);
-            } else if (std::isspace(contents.at(i)) != 0) {
-                Token token;
-                token.type = TokenType::ASSIGNMENT;
-                token.line = line_count;
-                token.character = character_count;
-                tokens.push_back(token);
-            } else {
-                i--;
-                character_count++;
-            }
-        } else if (current_char == '!') {
-            i++;
-            character_count++;
-
-            if (contents.at(i) == '=') {
-                Token token;
-                token.type = TokenType::CONDITION_OPERATOR_NE;
-                token.line = line_count;
-                token.character = character_count;
-                tokens.push_back(token);
-            } else if (std::isalnum(contents.at(i)) != 0) {
-                Token token;
-                token.type = TokenType::BANG;
-                token.line = line_count;
-                token.character = character_count;
-                tokens.push_back(token);
-            } else {
-                // @todo check me for correctness
-                printf("Invalid character following '!'.\n");
-                exit(EXIT_FAILURE);
-            }
-        } else if (current_char == '>') {
-            i++;
-            character_count++;
-
-            if (contents.at(i) == '=') {
-                Token token;
-                token.type = TokenType::CONDITION_OPERATOR_GTE;
-                token.line = line_count;
-                token.character = character_count;
-                tokens.push_back(token);
-            } else if (std::isalnum(contents.at(i)) != 0 || (std::isspace(contents.at(i)) != 0)) {
-                Token token;
-                token.type = TokenType::CONDITION_OPERATOR_GT;
-                token.line = line_count;
-                token.character = character_count;
-                tokens.push_back(token);
-            } else {
-                // @todo check me for correctness
-                i--;
-                character_count--;
-            }
-        } else if (current_char == '<') {
-            i++;
-            character_count++;
-
-            if (contents.at(i) == '=') {
-                Token token;
-                token.type = TokenType::CONDITION_OPERATOR_LTE;
-                token.line = line_count;
-                token.character = character_count;
-                tokens.push_back(token);
-            } else if (std::isalnum(contents.at(i)) != 0 || (std::isspace(contents.at(i)) != 0)) {
-                Token token;
-                token.type = TokenType::CONDITION_OPERATOR_LT;
-                token.line = line_count;
-                token.character = character_count;
-                tokens.push_back(token);
-            } else {
-                // @todo check me for correctness
-                i--;
-                character_count--;
-            }
-        } else if (current_char == '#') {
-            i++;
-
-            while (std::isalnum(contents.at(i)) != 0) {
-                buffer.push_back(contents.at(i));
-                i++;
-                character_count++;
-            }
-
+        } else {
+            // @todo check me for correctness
             i--;
             character_count--;
+        }
+    } else if (current_char == '#') {
+        i++;
 
-            if (buffer == "asm") {
-                Token token;
-                token.type = TokenType::ASM;
-                token.line = line_count;
-                token.character = character_count;
-                tokens.push_back(token);
-                buffer.clear();
-            } else {
-                printf("UNSUPPORTED COMPILER DIRECTIVE, ILLEGAL!\n");
-                exit(EXIT_FAILURE);
-            }
-        } else if (current_char == '"') {
+        while (std::isalnum(char_at(contents, i)) != 0) {
+            buffer.push_back(char_at(contents, i));
             i++;
+            character_count++;
+        }
 
-            while (contents.at(i) != '"') {
-                buffer.push_back(contents.at(i));
-                i++;
-                character_count++;
-            }
+        i--;
+        character_count--;
 
+        if (buffer == "asm") {
             Token token;
-            token.type = TokenType::STRING;
-            token.value = buffer;
+            token.type = TokenType::ASM;
             token.line = line_count;
-            token.character = character_count - buffer.length() + 1;
+            token.character = character_count;
             tokens.push_back(token);
             buffer.clear();
-        } else if (current_char == '\n') {
-            line_count++;
-            character_count = 1;
-            continue;
-        } else if (isspace(current_char) != 0) {
-            character_count++;
-            continue;
         } else {
-            printf("Unrecognizable character '%c' near or at %d:%d\n.", current_char, line_count, character_count);
-            exit(EXIT_FAILURE);
+            lex_error("UNSUPPORTED COMPILER DIRECTIVE, ILLEGAL!");
+            buffer.clear();
+        }
+    } else if (current_char == '"') {
+        i++;
+
+        int string_line = line_count;
+        int string_character = character_count;
+
+        while (i < (int) contents.length() && contents[i] != '"') {
+            buffer.push_back(contents[i]);
+            i++;
+            character_count++;
         }
+
+        if (i == (int) contents.length()) {
+            lex_error("Unterminated string starting at " + std::to_string(string_line) + ":" + std::to_string(string_character) + ".");
+            i--;
+            buffer.clear();
+            return;
+        }
+
+        Token token;
+        token.type = TokenType::STRING;
+        token.value = buffer;
+        token.line = line_count;
+        token.character = character_count - buffer.length() + 1;
+        tokens.push_back(token);
+        buffer.clear();
+    } else if (current_char == '\n') {
+        line_count++;
+        character_count = 1;
+        return;
+    } else if (isspace(current_char) != 0) {
+        character_count++;
+        return;
+    } else {
+        lex_error(std::string("Unrecognizable character '") + current_char + "' near or at " + std::to_string(line_count) + ":" + std::to_string(character_count) + ".");
     }
+}
 
+void push_end_of_file(const LexerState& state, std::vector<Token>& tokens)
+{
     // lets push this on at the end to make life easier in the future
     // (i have no idea if this will actually bring any benefits)
     Token token;
     token.type = TokenType::_EOF;
-    token.line = line_count;
-    token.character = character_count;
+    token.line = state.line;
+    token.character = state.character;
     tokens.push_back(token);
+}
+
+std::vector<Token> tokenize(const std::string& contents)
+{
+    std::vector<Token> tokens;
+
+    LexerState state;
+    std::string buffer;
+    lexer_error.clear();
+
+    for (; state.offset < (int) contents.length(); state.offset++) {
+        scan(contents, state, buffer, tokens);
+    }
+
+    push_end_of_file(state, tokens);
 
     return tokens;
 }
+
+bool next_token(const std::string& contents, LexerState& state, std::vector<Token>& tokens)
+{
+    size_t count = tokens.size();
+    std::string buffer;
+
+    while (tokens.size() == count) {
+        if (state.offset >= (int) contents.length()) {
+            push_end_of_file(state, tokens);
+            return false;
+        }
+
+        scan(contents, state, buffer, tokens);
+        state.offset++;
+    }
+
+    return true;
+}
@@ -1,7 +1,9 @@
 #ifndef LEXER_HPP
 #define LEXER_HPP
 
+#include <cstdint>
 #include <string>
+#include <vector>
 
 enum TokenType : uint8_t {
     INT_LIT,         // 123
@@ -14,6 +16,9 @@ enum TokenType : uint8_t {
 
     IF,              // if
     ELSE,            // else
+    WHILE,           // while
+    FN,              // fn
+    RETURN,          // return
 
     OPERATOR_PLUS,   // +
     OPERATOR_MINUS,  // -
@@ -27,10 +32,14 @@ enum TokenType : uint8_t {
     CONDITION_OPERATOR_GTE, // >=
     CONDITION_OPERATOR_LTE, // <=
 
+    LOGICAL_AND,     // &&
+    LOGICAL_OR,      // ||
+
     LEFT_PAREN,      // (
     RIGHT_PAREN,     // )
     LEFT_BRACE,      // {
     RIGHT_BRACE,     // }
+    COMMA,           // ,
 
     ASM, // #asm
 
@@ -40,12 +49,31 @@ enum TokenType : uint8_t {
 struct Token {
     TokenType type;
     std::string value;
+    int64_t number; // INT_LIT only
     int line;
     int character;
 };
 
+// where the lexer is in the source together with its line and character
+// counters, which is all it needs to carry on from there
+struct LexerState {
+    int offset = 0;
+    int line = 1;
+    int character = 1;
+};
+
 const char* print_token_type(TokenType token_type);
 
+// the first error since tokenize started or it was last cleared. the lexer
+// skips what it can't make sense of and carries on, so the tokens are only
+// good while this is empty
+extern std::string lexer_error;
+
 std::vector<Token> tokenize(const std::string& contents);
 
+// lexes from state up to and including the next token and appends it, state
+// is left right after it. at the end of contents the EOF token is appended
+// instead and false is returned
+bool next_token(const std::string& contents, LexerState& state, std::vector<Token>& tokens);
+
 #endif
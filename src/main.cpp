@@ -1,9 +1,21 @@
+#include <chrono>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
 #include <fstream>
 #include <sstream>
+#include <thread>
+#include <unistd.h>
 
 #include "lexer.hpp"
 #include "parser.hpp"
+#include "optimizer.hpp"
 #include "generator.hpp"
+#include "flat_ast.hpp"
+#include "profile.hpp"
+#include "stats.hpp"
+#include "server.hpp"
 
 #if defined (__APPLE__)
     #define _MAC_OS
@@ -13,61 +25,318 @@
     #define _ARM64
 #endif
 
-void compile_program(const std::stringstream& stream)
+// everything is written under a name of its own and renamed into place once
+// it's complete, so compiles running in the same directory at once, as the
+// server runs them, can't mix up each other's output
+bool compile_program(const Emitter& assembly, bool assemble)
 {
-    std::ofstream program;
-    program.open("./build/program.s");
-    program << stream.str();
-    program.close();
+    std::string suffix = "." + std::to_string(getpid());
+    std::string source = "./build/program.s" + suffix;
+
+    {
+        ScopedTimer timer("write");
+
+        int program = open(source.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        bool written = program >= 0 && assembly.flush(program);
+        if (program >= 0) {
+            close(program);
+        }
+        if (!written) {
+            unlink(source.c_str());
+            printf("\nCould not write ./build/program.s, exiting...\n");
+            return false;
+        }
+    }
+
+    if (!assemble) {
+        if (rename(source.c_str(), "./build/program.s") != 0) {
+            unlink(source.c_str());
+            printf("\nCould not write ./build/program.s, exiting...\n");
+            return false;
+        }
+        return true;
+    }
 
 #if defined (_MAC_OS) && defined (_ARM64)
-    std::system("as ./build/program.s -o ./build/program.o");
-    std::system("ld ./build/program.o -o ./build/program -e _main");
+    std::string object = "./build/program.o" + suffix;
+    std::string binary = "./build/program" + suffix;
+
+    {
+        ScopedTimer timer("assemble");
+        if (std::system(("as " + source + " -o " + object).c_str()) != 0) {
+            unlink(source.c_str());
+            unlink(object.c_str());
+            printf("\nCould not assemble ./build/program.s, exiting...\n");
+            return false;
+        }
+    }
+    {
+        ScopedTimer timer("link");
+        if (std::system(("ld " + object + " -o " + binary + " -e _main").c_str()) != 0) {
+            unlink(source.c_str());
+            unlink(object.c_str());
+            unlink(binary.c_str());
+            printf("\nCould not link ./build/program.o, exiting...\n");
+            return false;
+        }
+    }
+
+    if (rename(source.c_str(), "./build/program.s") != 0 || rename(object.c_str(), "./build/program.o") != 0
+        || rename(binary.c_str(), "./build/program") != 0) {
+        unlink(source.c_str());
+        unlink(object.c_str());
+        unlink(binary.c_str());
+        printf("\nCould not move the program into ./build, exiting...\n");
+        return false;
+    }
+
     printf("\nSuccessfully compiled program.\n");
+    return true;
 #else
+    if (rename(source.c_str(), "./build/program.s") != 0) {
+        unlink(source.c_str());
+    }
     printf("\nUnsupported compilation architecture, exiting...\n");
-    exit(EXIT_FAILURE);
+    return false;
 #endif
 }
 
-int main(int argc, char **argv)
+// a whole positive number, as taken by --threads= and the like
+bool parse_count(const char* text, int& count)
+{
+    char* end = nullptr;
+    errno = 0;
+    long value = strtol(text, &end, 10);
+
+    if (end == text || *end != '\0' || errno == ERANGE || value < 1 || value > INT_MAX) {
+        return false;
+    }
+
+    count = (int) value;
+    return true;
+}
+
+int compile(int argc, char** argv)
 {
-    if (argc < 2) {
+    const char* path = nullptr;
+    StatsFormat stats_format = StatsFormat::StatsNone;
+    bool assemble = true;
+    const char* ast_cache = nullptr;
+    bool instrument = false;
+    const char* profile_path = nullptr;
+    int threads = (int) std::thread::hardware_concurrency();
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--stats") == 0 || strcmp(argv[i], "--stats=text") == 0) {
+            stats_format = StatsFormat::StatsText;
+        } else if (strcmp(argv[i], "--stats=json") == 0) {
+            stats_format = StatsFormat::StatsJson;
+        } else if (strcmp(argv[i], "-S") == 0) {
+            // stop after writing build/program.s, e.g. to run it through ion-sim
+            assemble = false;
+        } else if (strncmp(argv[i], "--ast-cache=", 12) == 0) {
+            // where the optimized tree is kept between runs
+            ast_cache = argv[i] + 12;
+        } else if (strcmp(argv[i], "--instrument") == 0) {
+            // the program writes PROFILE_PATH when it exits
+            instrument = true;
+        } else if (strncmp(argv[i], "--profile-use=", 14) == 0) {
+            profile_path = argv[i] + 14;
+        } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+            // for code generation, the output doesn't depend on it
+            if (!parse_count(argv[i] + 10, threads)) {
+                printf("Invalid option '%s', expected a number of at least 1.\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        } else if (strncmp(argv[i], "--chunk-nodes=", 14) == 0) {
+            // smaller chunks than usual, so small programs go through the
+            // chunk boundaries as well
+            if (!parse_count(argv[i] + 14, chunk_nodes)) {
+                printf("Invalid option '%s', expected a number of at least 1.\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        } else if (strncmp(argv[i], "-", 1) == 0) {
+            printf("Unknown option '%s'.\n", argv[i]);
+            return EXIT_FAILURE;
+        } else {
+            path = argv[i];
+        }
+    }
+
+    if (path == nullptr) {
         printf("No file path provided.\n");
         return EXIT_FAILURE;
     }
 
-    std::string contents;
+    // the optimized tree of an unchanged source is mapped back in and code
+    // generation starts right away
+    FlatAST ast;
+    SourceStamp source = stamp_source(path);
+    bool loaded = false;
+
+    if (ast_cache != nullptr && source.inode != 0) {
+        ScopedTimer timer("load ast");
+        loaded = load_flat_ast(ast_cache, source, ast);
+    }
+
+    if (loaded) {
+        stats.bytes_in = source.size;
+        stats.ast_nodes = ast.size();
+    } else {
+        std::string contents;
+        {
+            ScopedTimer timer("read");
+
+            // the compile server has usually read the file already
+            const std::string* cached = find_cached_source(path);
+
+            if (cached != nullptr) {
+                contents = *cached;
+            } else {
+                std::stringstream contents_stream;
+                std::fstream input(path, std::ios::in);
+                contents_stream << input.rdbuf();
+                contents = contents_stream.str();
+            }
+        }
+        stats.bytes_in = contents.size();
+
+        std::vector<Token> tokens;
+        {
+            ScopedTimer timer("lex");
+            tokens = tokenize(contents);
+        }
+        stats.tokens = tokens.size();
+
+        if (!lexer_error.empty()) {
+            printf("%s\n", lexer_error.c_str());
+            return EXIT_FAILURE;
+        }
+
+        std::shared_ptr<ASTNode> ast_root_node;
+        {
+            ScopedTimer timer("parse");
+            ast_root_node = parse(&tokens);
+        }
+
+        if (!parser_error.empty()) {
+            printf("%s\n", parser_error.c_str());
+            return EXIT_FAILURE;
+        }
+
+        stats.ast_nodes = count_nodes(ast_root_node);
+
+        std::vector<std::string> diagnostics;
+        optimize(ast_root_node, diagnostics);
+
+        {
+            ScopedTimer timer("flatten");
+            flatten(ast_root_node, diagnostics, source, ast);
+        }
+
+        if (ast_cache != nullptr && !write_flat_ast(ast, ast_cache)) {
+            printf("Could not write %s, continuing without it.\n", ast_cache);
+        }
+    }
+
+    // the warnings are kept in the image, so a mapped tree gives the same
+    // ones as a compile
+    const char* diagnostic = ast.diagnostics;
+    for (uint32_t i = 0; i < ast.header->diagnostic_count; i++) {
+        printf("\x1b[33m[warning]\033[0m: %s\n", diagnostic);
+        diagnostic += strlen(diagnostic) + 1;
+    }
+
+    // a profile that doesn't fit the program is reported and left out
+    Profile profile;
+    bool profiled = profile_path != nullptr && load_profile(profile_path, ast, profile);
+
+    Emitter buffer;
     {
-        std::stringstream contents_stream;
-        std::fstream input(argv[1], std::ios::in);
-        contents_stream << input.rdbuf();
-        contents = contents_stream.str();
+        ScopedTimer timer("codegen");
+
+        buffer << ".global _main\n";
+        buffer << ".text\n";
+        buffer << "\n_main:\n";
+
+        generate(ast, buffer, instrument, profiled ? &profile : nullptr, threads);
     }
 
-    auto frontend_start = std::chrono::high_resolution_clock::now();
+    stats.bytes_out = buffer.size();
+    stats.instructions = buffer.instruction_count();
 
-    std::vector<Token> tokens = tokenize(contents);
+    bool compiled = compile_program(buffer, assemble);
 
-    auto ast_root_node = parse(&tokens);
+    if (stats_format != StatsFormat::StatsNone) {
+        print_stats(stats_format);
+    } else {
+        printf("\n");
+        printf("Front end took %lld μs\n", phase_microseconds("lex") + phase_microseconds("parse"));
+        printf("Back end took %lld μs\n", phase_microseconds("codegen"));
+    }
 
-    auto frontend_elapsed = std::chrono::high_resolution_clock::now() - frontend_start;
+    return compiled ? 0 : EXIT_FAILURE;
+}
 
-    auto backend_start = std::chrono::high_resolution_clock::now();
-    std::stringstream buffer;
-    buffer << ".global _main\n";
-    buffer << ".text\n";
-    buffer << "\n_main:\n";
+int main(int argc, char **argv)
+{
+    if (argc > 1 && strcmp(argv[1], "--server") == 0) {
+        ServerOptions options;
+        options.jobs = (int) sysconf(_SC_NPROCESSORS_ONLN);
+        options.idle_seconds = 300;
 
-    generate(ast_root_node, buffer);
+        for (int i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+                options.socket_path = argv[++i];
+            } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+                if (!parse_count(argv[++i], options.jobs)) {
+                    printf("Invalid value '%s' for --jobs, expected a number of at least 1.\n", argv[i]);
+                    return EXIT_FAILURE;
+                }
+            } else if (strcmp(argv[i], "--idle-timeout") == 0 && i + 1 < argc) {
+                if (!parse_count(argv[++i], options.idle_seconds)) {
+                    printf("Invalid value '%s' for --idle-timeout, expected a number of at least 1.\n", argv[i]);
+                    return EXIT_FAILURE;
+                }
+            } else {
+                printf("Unknown server option '%s'.\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        }
 
-    auto backend_elapsed = std::chrono::high_resolution_clock::now() - backend_start;
+        if (options.socket_path.empty()) {
+            options.socket_path = default_socket_path();
+        }
+        if (options.socket_path.empty()) {
+            return EXIT_FAILURE;
+        }
 
-    compile_program(buffer);
+        // sysconf gives -1 when it can't tell
+        if (options.jobs < 1) {
+            options.jobs = 1;
+        }
 
-    printf("\n");
-    printf("Front end took %lld μs\n", std::chrono::duration_cast<std::chrono::microseconds>(frontend_elapsed).count());
-    printf("Back end took %lld μs\n", std::chrono::duration_cast<std::chrono::microseconds>(backend_elapsed).count());
+        return run_server(options, compile);
+    }
+
+    if (argc > 1 && strcmp(argv[1], "--client") == 0) {
+        // everything after the client options is passed on as is
+        std::string socket_path;
+        int first = 2;
+
+        if (argc > 3 && strcmp(argv[2], "--socket") == 0) {
+            socket_path = argv[3];
+            first = 4;
+        } else {
+            socket_path = default_socket_path();
+        }
+
+        if (socket_path.empty()) {
+            return EXIT_FAILURE;
+        }
+
+        return run_client(socket_path, argc - first, argv + first);
+    }
 
-    return 0;
+    return compile(argc, argv);
 }
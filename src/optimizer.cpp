@@ -0,0 +1,1139 @@
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "optimizer.hpp"
+#include "stats.hpp"
+
+// bodies up to this many nodes are copied into their callers
+const int inline_node_limit = 24;
+
+struct InlineCandidate {
+    std::shared_ptr<ASTNode> function;
+    std::shared_ptr<ASTNode> expression;
+    std::unordered_map<std::string, int> parameter_uses;
+};
+
+bool contains_node_type(const std::shared_ptr<ASTNode>& node, NodeType type)
+{
+    if (node->type == type) {
+        return true;
+    }
+
+    for (const auto& child : node->children) {
+        if (contains_node_type(child, type)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool contains_call_to(const std::shared_ptr<ASTNode>& node, const std::string& name)
+{
+    if (node->type == NodeType::Call && node->value == name) {
+        return true;
+    }
+
+    for (const auto& child : node->children) {
+        if (contains_call_to(child, name)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// counts identifier uses, returns false if one isn't a parameter
+bool count_parameter_uses(const std::shared_ptr<ASTNode>& node, std::unordered_map<std::string, int>& uses)
+{
+    if (node->type == NodeType::Identifier) {
+        auto parameter = uses.find(node->value);
+        if (parameter == uses.end()) {
+            return false;
+        }
+
+        parameter->second++;
+    }
+
+    for (const auto& child : node->children) {
+        if (!count_parameter_uses(child, uses)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// a function qualifies if its body is a single 'return <expression>' that only
+// reads its parameters and doesn't call anything, so there's nothing to
+// evaluate in the callee besides the expression itself
+bool find_candidate(const std::shared_ptr<ASTNode>& function, InlineCandidate& candidate)
+{
+    const auto& body = function->children.back();
+
+    if (body->children.size() != 1) {
+        return false;
+    }
+
+    const auto& statement = body->children[0];
+    if (statement->type != NodeType::Return || statement->children.empty()) {
+        return false;
+    }
+
+    const auto& expression = statement->children[0];
+    if (count_nodes(expression) > inline_node_limit || contains_node_type(expression, NodeType::Call)) {
+        return false;
+    }
+
+    candidate.function = function;
+    candidate.expression = expression;
+
+    for (size_t i = 0; i + 1 < function->children.size(); i++) {
+        candidate.parameter_uses[function->children[i]->value] = 0;
+    }
+
+    return count_parameter_uses(expression, candidate.parameter_uses);
+}
+
+std::shared_ptr<ASTNode> clone(const std::shared_ptr<ASTNode>& node)
+{
+    auto copy = std::make_shared<ASTNode>(*node);
+
+    for (auto& child : copy->children) {
+        child = clone(child);
+    }
+
+    return copy;
+}
+
+std::shared_ptr<ASTNode> substitute(const std::shared_ptr<ASTNode>& node, const std::unordered_map<std::string, std::shared_ptr<ASTNode>>& arguments)
+{
+    if (node->type == NodeType::Identifier) {
+        return clone(arguments.at(node->value));
+    }
+
+    auto copy = std::make_shared<ASTNode>(*node);
+
+    for (auto& child : copy->children) {
+        child = substitute(child, arguments);
+    }
+
+    return copy;
+}
+
+bool is_trivial(const std::shared_ptr<ASTNode>& node)
+{
+    return node->type == NodeType::Number || node->type == NodeType::Identifier || node->type == NodeType::Boolean || node->type == NodeType::String;
+}
+
+// returns what should take the place of node, which is node itself unless it's
+// a call that got inlined
+std::shared_ptr<ASTNode> inline_calls(const std::shared_ptr<ASTNode>& node, const std::unordered_map<std::string, InlineCandidate>& candidates)
+{
+    // innermost calls first, so f(g(x)) can become one expression
+    for (auto& child : node->children) {
+        child = inline_calls(child, candidates);
+    }
+
+    if (node->type != NodeType::Call) {
+        return node;
+    }
+
+    auto candidate = candidates.find(node->value);
+    if (candidate == candidates.end()) {
+        return node;
+    }
+
+    const auto& function = candidate->second.function;
+    if (node->children.size() + 1 != function->children.size()) {
+        // leave the mismatch for the generator to report
+        return node;
+    }
+
+    std::unordered_map<std::string, std::shared_ptr<ASTNode>> arguments;
+
+    for (size_t i = 0; i < node->children.size(); i++) {
+        const auto& argument = node->children[i];
+        const auto& parameter = function->children[i]->value;
+
+        // an argument is evaluated exactly once by a call, so one that would
+        // be duplicated or dropped has to be cheap and free of side effects
+        if (contains_node_type(argument, NodeType::Call)) {
+            return node;
+        }
+        if (!is_trivial(argument) && candidate->second.parameter_uses.at(parameter) > 1) {
+            return node;
+        }
+
+        arguments[parameter] = argument;
+    }
+
+    return substitute(candidate->second.expression, arguments);
+}
+
+void inline_functions(const std::shared_ptr<ASTNode>& root)
+{
+    std::unordered_map<std::string, InlineCandidate> candidates;
+    std::unordered_map<std::string, int> declarations;
+
+    for (const auto& child : root->children) {
+        if (child->type == NodeType::Function) {
+            declarations[child->value]++;
+        }
+    }
+
+    for (const auto& child : root->children) {
+        InlineCandidate candidate;
+
+        // duplicates are left alone so the generator still reports them
+        if (child->type == NodeType::Function && declarations[child->value] == 1 && find_candidate(child, candidate)) {
+            candidates[child->value] = candidate;
+        }
+    }
+
+    if (candidates.empty()) {
+        return;
+    }
+
+    inline_calls(root, candidates);
+
+    // a fully inlined function doesn't need to be generated at all
+    std::vector<std::shared_ptr<ASTNode>> children;
+
+    for (const auto& child : root->children) {
+        if (child->type == NodeType::Function && candidates.count(child->value) != 0 && !contains_call_to(root, child->value)) {
+            continue;
+        }
+
+        children.push_back(child);
+    }
+
+    root->children = children;
+}
+
+bool is_number(const std::shared_ptr<ASTNode>& node, int64_t value)
+{
+    return node->type == NodeType::Number && node->number == value;
+}
+
+std::shared_ptr<ASTNode> make_number(int64_t value);
+
+std::shared_ptr<ASTNode> make_negation(const std::shared_ptr<ASTNode>& operand)
+{
+    auto negation = std::make_shared<ASTNode>(NodeType::BinaryOperator, "-");
+    negation->children.push_back(make_number(0));
+    negation->children.push_back(operand);
+
+    return negation;
+}
+
+// arithmetic wraps around like the generated code does, and division follows
+// sdiv: x / 0 is 0 and INT64_MIN / -1 is INT64_MIN
+int64_t fold(const std::string& operation, int64_t left, int64_t right)
+{
+    uint64_t a = (uint64_t) left;
+    uint64_t b = (uint64_t) right;
+
+    if (operation == "+") {
+        return (int64_t) (a + b);
+    }
+    if (operation == "-") {
+        return (int64_t) (a - b);
+    }
+    if (operation == "*") {
+        return (int64_t) (a * b);
+    }
+
+    if (right == 0) {
+        return 0;
+    }
+    if (right == -1) {
+        return (int64_t) (0 - a);
+    }
+    return left / right;
+}
+
+// folds constants and applies the identities that hold for wrapping 64 bit
+// arithmetic. operands are only dropped when they can't have side effects
+std::shared_ptr<ASTNode> simplify(const std::shared_ptr<ASTNode>& node)
+{
+    for (auto& child : node->children) {
+        child = simplify(child);
+    }
+
+    if (node->type != NodeType::BinaryOperator) {
+        return node;
+    }
+
+    const std::string& operation = node->value;
+    auto left = node->children[0];
+    auto right = node->children[1];
+
+    if (left->type == NodeType::Number && right->type == NodeType::Number) {
+        return make_number(fold(operation, left->number, right->number));
+    }
+
+    // constants go on the right of + and *, where the generator looks for them
+    if ((operation == "+" || operation == "*") && left->type == NodeType::Number) {
+        std::swap(left, right);
+        node->children[0] = left;
+        node->children[1] = right;
+    }
+
+    bool pure = !contains_node_type(left, NodeType::Call);
+
+    if (operation == "+" || operation == "-") {
+        if (is_number(right, 0)) {
+            return left;
+        }
+        if (operation == "-" && is_number(left, 0) && right->type == NodeType::BinaryOperator && right->value == "-" && is_number(right->children[0], 0)) {
+            // 0 - (0 - x)
+            return right->children[1];
+        }
+        if (operation == "-" && left->type == NodeType::Identifier && right->type == NodeType::Identifier && left->value == right->value) {
+            return make_number(0);
+        }
+    }
+
+    if (operation == "*") {
+        if (is_number(right, 1)) {
+            return left;
+        }
+        if (is_number(right, 0) && pure) {
+            return make_number(0);
+        }
+        if (is_number(right, -1)) {
+            return make_negation(left);
+        }
+    }
+
+    if (operation == "/") {
+        if (is_number(right, 1)) {
+            return left;
+        }
+        if (is_number(right, -1)) {
+            return make_negation(left);
+        }
+    }
+
+    // (x * a) * b and (x + a) + b with constants a and b
+    if ((operation == "*" || operation == "+") && right->type == NodeType::Number && left->type == NodeType::BinaryOperator && left->value == operation && left->children[1]->type == NodeType::Number) {
+        node->children[0] = left->children[0];
+        node->children[1] = make_number(fold(operation, left->children[1]->number, right->number));
+
+        return simplify(node);
+    }
+
+    return node;
+}
+
+void simplify_expressions(const std::shared_ptr<ASTNode>& root)
+{
+    for (auto& child : root->children) {
+        child = simplify(child);
+    }
+}
+
+// compiler temporaries start with '__', which the lexer never produces for an
+// identifier, so they can't clash with user variables
+int temporary_index = 0;
+
+std::string make_temporary(const char* prefix)
+{
+    return prefix + std::to_string(temporary_index++);
+}
+
+std::shared_ptr<ASTNode> make_assignment(const std::string& name, const std::shared_ptr<ASTNode>& expression)
+{
+    auto assignment = std::make_shared<ASTNode>(NodeType::Assignment, name);
+    assignment->children.push_back(expression);
+
+    return assignment;
+}
+
+std::shared_ptr<ASTNode> make_number(int64_t value)
+{
+    auto number = std::make_shared<ASTNode>(NodeType::Number, std::to_string(value));
+    number->number = value;
+
+    return number;
+}
+
+void collect_assigned(const std::shared_ptr<ASTNode>& node, std::unordered_map<std::string, int>& assigned)
+{
+    if (node->type == NodeType::Assignment) {
+        assigned[node->value]++;
+    }
+
+    for (const auto& child : node->children) {
+        collect_assigned(child, assigned);
+    }
+}
+
+// #asm can read and write anything, so loops containing it are left alone
+bool is_opaque(const std::shared_ptr<ASTNode>& node)
+{
+    return contains_node_type(node, NodeType::Directive);
+}
+
+// i = i + c or i = i - c with a constant c, returns c
+bool match_induction_step(const std::shared_ptr<ASTNode>& statement, int64_t& step)
+{
+    if (statement->type != NodeType::Assignment) {
+        return false;
+    }
+
+    const auto& expression = statement->children[0];
+    if (expression->type != NodeType::BinaryOperator || (expression->value != "+" && expression->value != "-")) {
+        return false;
+    }
+
+    const auto& left = expression->children[0];
+    const auto& right = expression->children[1];
+
+    if (right->type == NodeType::Number && left->type == NodeType::Identifier && left->value == statement->value) {
+        step = expression->value == "+" ? right->number : (int64_t) (0 - (uint64_t) right->number);
+        return true;
+    }
+
+    if (expression->value == "+" && left->type == NodeType::Number && right->type == NodeType::Identifier && right->value == statement->value) {
+        step = left->number;
+        return true;
+    }
+
+    return false;
+}
+
+// i * k or k * i for a constant k, returns k
+bool match_induction_product(const std::shared_ptr<ASTNode>& node, const std::string& variable, int64_t& factor)
+{
+    if (node->type != NodeType::BinaryOperator || node->value != "*") {
+        return false;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        const auto& operand = node->children[i];
+        const auto& other = node->children[1 - i];
+
+        if (operand->type == NodeType::Identifier && operand->value == variable && other->type == NodeType::Number) {
+            factor = other->number;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// swaps every i * k below node for the derived variable tracking it
+void replace_induction_products(std::shared_ptr<ASTNode>& node, const std::string& variable, std::map<int64_t, std::string>& derived)
+{
+    int64_t factor = 0;
+
+    if (match_induction_product(node, variable, factor)) {
+        auto existing = derived.find(factor);
+        if (existing == derived.end()) {
+            existing = derived.insert({ factor, make_temporary("__iv") }).first;
+        }
+
+        node = std::make_shared<ASTNode>(NodeType::Identifier, existing->second);
+        return;
+    }
+
+    for (auto& child : node->children) {
+        replace_induction_products(child, variable, derived);
+    }
+}
+
+// for a basic induction variable i, stepped once per iteration by a constant
+// c at the top level of the body, every i * k becomes a variable that starts
+// at i * k before the loop and grows by c * k right after i is stepped. the
+// multiplication turns into an add, and wrapping arithmetic keeps the two
+// equal even on overflow
+void reduce_induction_variables(const std::shared_ptr<ASTNode>& loop, std::vector<std::shared_ptr<ASTNode>>& prelude)
+{
+    auto& body = loop->children[1]->children;
+
+    std::unordered_map<std::string, int> assigned;
+    collect_assigned(loop, assigned);
+
+    for (size_t i = 0; i < body.size(); i++) {
+        int64_t step = 0;
+
+        if (!match_induction_step(body[i], step) || assigned[body[i]->value] != 1) {
+            continue;
+        }
+
+        std::string variable = body[i]->value;
+        std::map<int64_t, std::string> derived;
+
+        replace_induction_products(loop->children[0], variable, derived);
+        for (auto& statement : body) {
+            replace_induction_products(statement, variable, derived);
+        }
+
+        std::vector<std::shared_ptr<ASTNode>> updates;
+
+        for (const auto& product : derived) {
+            auto initial = std::make_shared<ASTNode>(NodeType::BinaryOperator, "*");
+            initial->children.push_back(std::make_shared<ASTNode>(NodeType::Identifier, variable));
+            initial->children.push_back(make_number(product.first));
+            prelude.push_back(make_assignment(product.second, initial));
+
+            auto increment = std::make_shared<ASTNode>(NodeType::BinaryOperator, "+");
+            increment->children.push_back(std::make_shared<ASTNode>(NodeType::Identifier, product.second));
+            increment->children.push_back(make_number((int64_t) ((uint64_t) step * (uint64_t) product.first)));
+            updates.push_back(make_assignment(product.second, increment));
+        }
+
+        body.insert(body.begin() + i + 1, updates.begin(), updates.end());
+        i += updates.size();
+    }
+}
+
+bool is_invariant(const std::shared_ptr<ASTNode>& node, const std::unordered_map<std::string, int>& assigned)
+{
+    switch (node->type) {
+        case NodeType::Number:
+        case NodeType::Boolean:
+        case NodeType::String:
+            return true;
+        case NodeType::Identifier:
+            return assigned.count(node->value) == 0;
+        case NodeType::BinaryOperator:
+            return is_invariant(node->children[0], assigned) && is_invariant(node->children[1], assigned);
+        default:
+            // calls, conditions and logical operators stay where they are
+            return false;
+    }
+}
+
+// replaces the largest invariant arithmetic below node with temporaries that
+// are computed once before the loop
+void hoist_invariants(std::shared_ptr<ASTNode>& node, const std::unordered_map<std::string, int>& assigned, std::vector<std::shared_ptr<ASTNode>>& prelude)
+{
+    if (node->type == NodeType::BinaryOperator && is_invariant(node, assigned)) {
+        std::string name = make_temporary("__licm");
+        prelude.push_back(make_assignment(name, node));
+
+        node = std::make_shared<ASTNode>(NodeType::Identifier, name);
+        return;
+    }
+
+    for (auto& child : node->children) {
+        hoist_invariants(child, assigned, prelude);
+    }
+}
+
+// rewrites loops inside a statement list, inserting whatever they need
+// computed up front right before them
+void optimize_statements(std::vector<std::shared_ptr<ASTNode>>& statements);
+
+void optimize_loops_in(const std::shared_ptr<ASTNode>& node)
+{
+    for (const auto& child : node->children) {
+        if (child->type == NodeType::Block) {
+            optimize_statements(child->children);
+        } else {
+            optimize_loops_in(child);
+        }
+    }
+}
+
+void optimize_statements(std::vector<std::shared_ptr<ASTNode>>& statements)
+{
+    for (size_t i = 0; i < statements.size(); i++) {
+        auto loop = statements[i];
+
+        if (loop->type != NodeType::While || is_opaque(loop)) {
+            optimize_loops_in(loop);
+            continue;
+        }
+
+        std::vector<std::shared_ptr<ASTNode>> prelude;
+
+        // outer induction variables are reduced before inner loops are
+        // looked at, so their products reach the inner loops as plain
+        // variables that can stay put
+        reduce_induction_variables(loop, prelude);
+
+        // inner loops next, their preludes then become part of this body
+        optimize_loops_in(loop);
+
+        std::unordered_map<std::string, int> assigned;
+        collect_assigned(loop, assigned);
+
+        hoist_invariants(loop->children[0], assigned, prelude);
+
+        auto& body = loop->children[1]->children;
+        for (size_t j = 0; j < body.size(); j++) {
+            // an inner loop's hoisted temporary is assigned exactly once, so
+            // if its value doesn't change here either the whole assignment
+            // can keep moving out
+            if (body[j]->type == NodeType::Assignment && body[j]->value.compare(0, 6, "__licm") == 0 && is_invariant(body[j]->children[0], assigned)) {
+                prelude.push_back(body[j]);
+                body.erase(body.begin() + j);
+                j--;
+                continue;
+            }
+
+            hoist_invariants(body[j], assigned, prelude);
+        }
+
+        statements.insert(statements.begin() + i, prelude.begin(), prelude.end());
+        i += prelude.size();
+    }
+}
+
+void optimize_loops(const std::shared_ptr<ASTNode>& root)
+{
+    temporary_index = 0;
+    optimize_statements(root->children);
+}
+
+// value numbers for one straight-line region: two nodes with the same number
+// are known to compute the same value
+struct ValueNumbering {
+    std::unordered_map<std::string, int> variables;
+    std::unordered_map<int64_t, int> constants;
+    std::unordered_map<uint64_t, int> expressions;
+    std::unordered_map<const ASTNode*, int> numbers;
+    std::unordered_map<int, int> occurrences;
+    int next = 0;
+
+    // the maps keep their buckets from one region to the next
+    void clear()
+    {
+        variables.clear();
+        constants.clear();
+        expressions.clear();
+        numbers.clear();
+        occurrences.clear();
+        next = 0;
+    }
+};
+
+// operators are at most two characters, which fit next to the two operand
+// numbers in a single key
+uint64_t expression_key(const std::string& op, int left, int right)
+{
+    uint64_t code = (uint8_t) op[0] | (op.size() > 1 ? (uint64_t) (uint8_t) op[1] << 8 : 0);
+    return code << 48 | (uint64_t) left << 24 | (uint64_t) right;
+}
+
+// numbers a side effect free expression, or returns -1 for one that involves
+// a call or anything else the generator doesn't compute into x0 plainly
+int number_value(const std::shared_ptr<ASTNode>& node, ValueNumbering& values)
+{
+    switch (node->type) {
+        case NodeType::Number: {
+            auto constant = values.constants.find(node->number);
+            if (constant == values.constants.end()) {
+                constant = values.constants.insert({ node->number, values.next++ }).first;
+            }
+            return constant->second;
+        }
+        case NodeType::Identifier: {
+            // the first read of a variable in the region stands for whatever
+            // it held on entry
+            auto variable = values.variables.find(node->value);
+            if (variable == values.variables.end()) {
+                variable = values.variables.insert({ node->value, values.next++ }).first;
+            }
+            return variable->second;
+        }
+        case NodeType::BinaryOperator: {
+            int left = number_value(node->children[0], values);
+            int right = number_value(node->children[1], values);
+
+            if (left < 0 || right < 0 || values.next >= 1 << 24) {
+                return -1;
+            }
+
+            // operand order doesn't matter for these
+            if ((node->value == "+" || node->value == "*") && right < left) {
+                std::swap(left, right);
+            }
+
+            uint64_t key = expression_key(node->value, left, right);
+
+            auto expression = values.expressions.find(key);
+            if (expression == values.expressions.end()) {
+                expression = values.expressions.insert({ key, values.next++ }).first;
+            }
+
+            values.numbers[node.get()] = expression->second;
+            values.occurrences[expression->second]++;
+
+            return expression->second;
+        }
+        default: {
+            for (const auto& child : node->children) {
+                number_value(child, values);
+            }
+            return -1;
+        }
+    }
+}
+
+// swaps every expression below node that's computed more than once in the
+// region for a temporary, defining the temporary the first time around
+void replace_common(std::shared_ptr<ASTNode>& node, ValueNumbering& values, std::unordered_map<int, std::string>& temporaries, std::vector<std::shared_ptr<ASTNode>>& definitions)
+{
+    auto number = values.numbers.find(node.get());
+
+    if (number != values.numbers.end() && values.occurrences[number->second] > 1) {
+        auto temporary = temporaries.find(number->second);
+
+        if (temporary == temporaries.end()) {
+            temporary = temporaries.insert({ number->second, make_temporary("__cse") }).first;
+            definitions.push_back(make_assignment(temporary->second, node));
+        }
+
+        node = std::make_shared<ASTNode>(NodeType::Identifier, temporary->second);
+        return;
+    }
+
+    for (auto& child : node->children) {
+        replace_common(child, values, temporaries, definitions);
+    }
+}
+
+// the expression a statement evaluates before anything else happens, or
+// nullptr. while conditions run again on every iteration so they don't belong
+// to the region in front of the loop
+std::shared_ptr<ASTNode>* region_expression(const std::shared_ptr<ASTNode>& statement)
+{
+    switch (statement->type) {
+        case NodeType::Assignment:
+        case NodeType::If:
+        case NodeType::Return:
+            return statement->children.empty() ? nullptr : &statement->children[0];
+        default:
+            return nullptr;
+    }
+}
+
+void eliminate_common_subexpressions_in(std::vector<std::shared_ptr<ASTNode>>& statements);
+
+void eliminate_common_subexpressions_below(const std::shared_ptr<ASTNode>& node)
+{
+    for (const auto& child : node->children) {
+        if (child->type == NodeType::Block) {
+            eliminate_common_subexpressions_in(child->children);
+        } else if (child->type == NodeType::Else || child->type == NodeType::Function || child->type == NodeType::While) {
+            eliminate_common_subexpressions_below(child);
+        }
+    }
+}
+
+// regions are runs of assignments and calls, plus the condition of an if
+// that ends them. anything that branches, loops or runs #asm starts a new
+// one, and assignments give the variable a new value number so expressions
+// over its old value no longer match
+void eliminate_common_subexpressions_in(std::vector<std::shared_ptr<ASTNode>>& statements)
+{
+    std::vector<std::shared_ptr<ASTNode>> rewritten;
+    rewritten.reserve(statements.size());
+
+    ValueNumbering values;
+    std::unordered_map<int, std::string> temporaries;
+    size_t start = 0;
+
+    while (start < statements.size()) {
+        size_t end = start;
+        values.clear();
+
+        for (; end < statements.size(); end++) {
+            const auto& statement = statements[end];
+
+            if (statement->type == NodeType::Assignment) {
+                int value = number_value(statement->children[0], values);
+                values.variables[statement->value] = value >= 0 ? value : values.next++;
+                continue;
+            }
+
+            if (statement->type == NodeType::Call) {
+                number_value(statement, values);
+                continue;
+            }
+
+            if (statement->type == NodeType::If || statement->type == NodeType::Return) {
+                if (!statement->children.empty()) {
+                    number_value(statement->children[0], values);
+                }
+                end++;
+            }
+
+            break;
+        }
+
+        temporaries.clear();
+
+        for (size_t i = start; i < end; i++) {
+            std::shared_ptr<ASTNode>* expression = region_expression(statements[i]);
+
+            // definitions go in front of the statement that first needs them
+            if (expression != nullptr) {
+                replace_common(*expression, values, temporaries, rewritten);
+            } else {
+                replace_common(statements[i], values, temporaries, rewritten);
+            }
+
+            rewritten.push_back(statements[i]);
+        }
+
+        // statements that end a region without taking part in one
+        if (end == start) {
+            rewritten.push_back(statements[end]);
+            end++;
+        }
+
+        for (size_t i = start; i < end; i++) {
+            eliminate_common_subexpressions_below(statements[i]);
+        }
+
+        start = end;
+    }
+
+    statements.swap(rewritten);
+}
+
+void eliminate_common_subexpressions(const std::shared_ptr<ASTNode>& root)
+{
+    eliminate_common_subexpressions_in(root->children);
+}
+
+// variables that may still be read later. #asm can read anything, which is
+// what everything stands for
+struct Liveness {
+    std::unordered_set<std::string> variables;
+    bool everything = false;
+
+    bool contains(const std::string& name) const
+    {
+        return everything || variables.count(name) != 0;
+    }
+
+    void merge(const Liveness& other)
+    {
+        everything = everything || other.everything;
+        variables.insert(other.variables.begin(), other.variables.end());
+    }
+
+    bool operator==(const Liveness& other) const
+    {
+        return everything == other.everything && variables == other.variables;
+    }
+};
+
+void collect_reads(const std::shared_ptr<ASTNode>& node, std::unordered_set<std::string>& reads)
+{
+    if (node->type == NodeType::Identifier) {
+        reads.insert(node->value);
+    }
+
+    for (const auto& child : node->children) {
+        collect_reads(child, reads);
+    }
+}
+
+// the outermost calls in an expression, in evaluation order
+void collect_calls(const std::shared_ptr<ASTNode>& node, std::vector<std::shared_ptr<ASTNode>>& calls)
+{
+    if (node->type == NodeType::Call) {
+        calls.push_back(node);
+        return;
+    }
+
+    for (const auto& child : node->children) {
+        collect_calls(child, calls);
+    }
+}
+
+// marks the assignments that introduce a variable rather than update one, using
+// the same scoping as the generator: a function body shares its parameters'
+// scope and every other block opens its own
+void find_declarations(const std::vector<std::shared_ptr<ASTNode>>& statements, std::vector<std::unordered_set<std::string>>& scopes, std::unordered_set<const ASTNode*>& declarations)
+{
+    for (const auto& statement : statements) {
+        if (statement->type == NodeType::Assignment) {
+            bool visible = false;
+            for (const auto& scope : scopes) {
+                visible = visible || scope.count(statement->value) != 0;
+            }
+
+            if (!visible) {
+                scopes.back().insert(statement->value);
+                declarations.insert(statement.get());
+            }
+            continue;
+        }
+
+        if (statement->type == NodeType::Function) {
+            continue;
+        }
+
+        for (const auto& child : statement->children) {
+            const auto& block = child->type == NodeType::Else ? child->children[0] : child;
+
+            if (block->type == NodeType::Block) {
+                scopes.emplace_back();
+                find_declarations(block->children, scopes, declarations);
+                scopes.pop_back();
+            }
+        }
+    }
+}
+
+Liveness live_before(std::vector<std::shared_ptr<ASTNode>>& statements, Liveness live, bool eliminate, const std::unordered_set<const ASTNode*>& declarations);
+
+Liveness live_before_loop(const std::shared_ptr<ASTNode>& loop, const Liveness& live_after, bool eliminate, const std::unordered_set<const ASTNode*>& declarations)
+{
+    // live at the condition, which runs after the loop is entered and after
+    // every iteration of the body
+    Liveness entry = live_after;
+    collect_reads(loop->children[0], entry.variables);
+
+    while (true) {
+        Liveness next = live_after;
+        collect_reads(loop->children[0], next.variables);
+        next.merge(live_before(loop->children[1]->children, entry, false, declarations));
+
+        if (next == entry) {
+            break;
+        }
+        entry = next;
+    }
+
+    if (eliminate) {
+        live_before(loop->children[1]->children, entry, true, declarations);
+    }
+
+    return entry;
+}
+
+// walks statements backwards from what's live after them, and with eliminate
+// set drops the assignments nobody reads
+Liveness live_before(std::vector<std::shared_ptr<ASTNode>>& statements, Liveness live, bool eliminate, const std::unordered_set<const ASTNode*>& declarations)
+{
+    // names assigned inside nested blocks after the current statement, up to
+    // the next assignment at this level that stays
+    std::unordered_map<std::string, int> assigned_later;
+
+    for (int i = (int) statements.size() - 1; i >= 0; i--) {
+        auto statement = statements[i];
+
+        switch (statement->type) {
+            case NodeType::Assignment: {
+                const auto& expression = statement->children[0];
+
+                // a dead store that declares a variable assigned again in a
+                // nested block stays, otherwise those assignments would each
+                // declare a variable of their own
+                bool dead = !live.contains(statement->value);
+                if (dead && declarations.count(statement.get()) != 0 && assigned_later.count(statement->value) != 0) {
+                    dead = false;
+                }
+
+                if (!dead) {
+                    assigned_later.erase(statement->value);
+                    live.variables.erase(statement->value);
+                    collect_reads(expression, live.variables);
+                    break;
+                }
+
+                // calls can have side effects, so those are kept as plain
+                // statements
+                std::vector<std::shared_ptr<ASTNode>> calls;
+                collect_calls(expression, calls);
+
+                for (const auto& call : calls) {
+                    collect_reads(call, live.variables);
+                }
+
+                if (eliminate) {
+                    statements.erase(statements.begin() + i);
+                    statements.insert(statements.begin() + i, calls.begin(), calls.end());
+                }
+                break;
+            }
+            case NodeType::If: {
+                Liveness live_then = live_before(statement->children[1]->children, live, eliminate, declarations);
+
+                if (statement->children.back()->type == NodeType::Else) {
+                    live = live_before(statement->children.back()->children[0]->children, live, eliminate, declarations);
+                }
+
+                live.merge(live_then);
+                collect_reads(statement->children[0], live.variables);
+                break;
+            }
+            case NodeType::While: {
+                live = live_before_loop(statement, live, eliminate, declarations);
+                break;
+            }
+            case NodeType::Return: {
+                // nothing after a return runs
+                live = Liveness();
+                collect_reads(statement, live.variables);
+                break;
+            }
+            case NodeType::Directive: {
+                live.everything = true;
+                break;
+            }
+            case NodeType::Function: {
+                // analyzed on its own
+                break;
+            }
+            default: {
+                collect_reads(statement, live.variables);
+                break;
+            }
+        }
+
+        if (statement->type != NodeType::Assignment) {
+            collect_assigned(statement, assigned_later);
+        }
+    }
+
+    return live;
+}
+
+// the assignments in source order and the variables read under node. #asm
+// can read any variable it can see, which is everything assigned before it
+// and, inside a loop, everything the loop assigns for the next time around
+void collect_uses(const std::shared_ptr<ASTNode>& node, std::vector<std::shared_ptr<ASTNode>>& loops, std::vector<std::string>& assigned, std::unordered_set<std::string>& seen, std::unordered_set<std::string>& reads)
+{
+    if (node->type == NodeType::Directive) {
+        reads.insert(assigned.begin(), assigned.end());
+
+        for (const auto& loop : loops) {
+            std::unordered_map<std::string, int> in_loop;
+            collect_assigned(loop, in_loop);
+
+            for (const auto& name : in_loop) {
+                reads.insert(name.first);
+            }
+        }
+        return;
+    }
+
+    if (node->type == NodeType::Identifier) {
+        reads.insert(node->value);
+    }
+
+    if (node->type == NodeType::While) {
+        loops.push_back(node);
+    }
+
+    // other functions are checked on their own
+    for (const auto& child : node->children) {
+        if (child->type != NodeType::Function) {
+            collect_uses(child, loops, assigned, seen, reads);
+        }
+    }
+
+    if (node->type == NodeType::While) {
+        loops.pop_back();
+    }
+
+    // after the value, which is computed before the variable exists
+    if (node->type == NodeType::Assignment && seen.insert(node->value).second) {
+        assigned.push_back(node->value);
+    }
+}
+
+// variables that are assigned but never read anywhere in the body
+void warn_unused_in(const std::shared_ptr<ASTNode>& body, const std::vector<std::string>& parameters, const std::string& function, std::vector<std::string>& diagnostics)
+{
+    std::vector<std::string> assigned = parameters;
+    std::unordered_set<std::string> seen(parameters.begin(), parameters.end());
+    std::unordered_set<std::string> reads;
+    std::vector<std::shared_ptr<ASTNode>> loops;
+
+    collect_uses(body, loops, assigned, seen, reads);
+
+    for (const auto& name : assigned) {
+        if (reads.count(name) != 0 || name.compare(0, 2, "__") == 0) {
+            continue;
+        }
+
+        if (function.empty()) {
+            diagnostics.push_back("variable '" + name + "' is never used.");
+        } else {
+            diagnostics.push_back("variable '" + name + "' in function '" + function + "' is never used.");
+        }
+    }
+}
+
+void warn_unused_variables(const std::shared_ptr<ASTNode>& root, std::vector<std::string>& diagnostics)
+{
+    warn_unused_in(root, {}, "", diagnostics);
+
+    for (const auto& child : root->children) {
+        if (child->type != NodeType::Function) {
+            continue;
+        }
+
+        std::vector<std::string> parameters;
+        for (size_t i = 0; i + 1 < child->children.size(); i++) {
+            parameters.push_back(child->children[i]->value);
+        }
+
+        warn_unused_in(child->children.back(), parameters, child->value, diagnostics);
+    }
+}
+
+void eliminate_dead_stores(const std::shared_ptr<ASTNode>& root)
+{
+    std::unordered_set<const ASTNode*> declarations;
+    std::vector<std::unordered_set<std::string>> scopes(1);
+
+    find_declarations(root->children, scopes, declarations);
+    live_before(root->children, Liveness(), true, declarations);
+
+    for (const auto& child : root->children) {
+        if (child->type != NodeType::Function) {
+            continue;
+        }
+
+        scopes.assign(1, std::unordered_set<std::string>());
+        for (size_t i = 0; i + 1 < child->children.size(); i++) {
+            scopes[0].insert(child->children[i]->value);
+        }
+
+        auto& body = child->children.back();
+
+        find_declarations(body->children, scopes, declarations);
+        live_before(body->children, Liveness(), true, declarations);
+    }
+}
+
+void optimize(const std::shared_ptr<ASTNode>& root, std::vector<std::string>& diagnostics)
+{
+    // before anything is rewritten, so the warnings match the source
+    warn_unused_variables(root, diagnostics);
+
+    {
+        ScopedTimer timer("inline");
+        inline_functions(root);
+    }
+    {
+        ScopedTimer timer("simplify");
+        simplify_expressions(root);
+    }
+    {
+        ScopedTimer timer("loops");
+        optimize_loops(root);
+    }
+    {
+        ScopedTimer timer("cse");
+        eliminate_common_subexpressions(root);
+    }
+    {
+        ScopedTimer timer("dead stores");
+        eliminate_dead_stores(root);
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef OPTIMIZER_HPP
+#define OPTIMIZER_HPP
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "parser.hpp"
+
+// rewrites the tree in place between parsing and code generation. warnings
+// about the source are added to diagnostics instead of being printed
+void optimize(const std::shared_ptr<ASTNode>& root, std::vector<std::string>& diagnostics);
+
+// replaces calls to small single expression functions with their body
+void inline_functions(const std::shared_ptr<ASTNode>& root);
+
+// folds constants and removes arithmetic that doesn't change the value
+void simplify_expressions(const std::shared_ptr<ASTNode>& root);
+
+// hoists loop invariant arithmetic out of while loops and turns
+// multiplications of induction variables into additions
+void optimize_loops(const std::shared_ptr<ASTNode>& root);
+
+// computes expressions repeated within straight-line code once into a
+// temporary
+void eliminate_common_subexpressions(const std::shared_ptr<ASTNode>& root);
+
+// removes assignments whose value is never read
+void eliminate_dead_stores(const std::shared_ptr<ASTNode>& root);
+
+// a warning for every variable that is assigned but never read
+void warn_unused_variables(const std::shared_ptr<ASTNode>& root, std::vector<std::string>& diagnostics);
+
+#endif
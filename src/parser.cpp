@@ -17,11 +17,29 @@ const char* print_node_type(NodeType node_type)
         case NodeType::Block: return "Block";
         case NodeType::Directive: return "Directive";
         case NodeType::String: return "String";
+        case NodeType::Function: return "Function";
+        case NodeType::Call: return "Call";
+        case NodeType::Return: return "Return";
+        case NodeType::LogicalOperator: return "LogicalOperator";
+        case NodeType::While: return "While";
     }
 }
 
 int current = 0;
 
+std::string parser_error;
+
+// records the first error and gives a stand-in for the node that couldn't be
+// parsed
+std::shared_ptr<ASTNode> syntax_error(const std::string& message)
+{
+    if (parser_error.empty()) {
+        parser_error = message;
+    }
+
+    return std::make_shared<ASTNode>(NodeType::Block, "");
+}
+
 Token peek(const std::vector<Token>* tokens, int lookahead = 0)
 {
     if (current + lookahead < tokens->size()) {
@@ -50,10 +68,64 @@ const bool match(const std::vector<Token>* tokens, TokenType type)
     return false;
 }
 
+std::shared_ptr<ASTNode> parse_call(const std::vector<Token>* tokens)
+{
+    Token identifier = advance(tokens);
+    advance(tokens); // discard opening parenthesis
+
+    std::shared_ptr<ASTNode> call_node = std::make_shared<ASTNode>(NodeType::Call, identifier.value);
+
+    if (match(tokens, TokenType::RIGHT_PAREN)) {
+        return call_node;
+    }
+
+    do {
+        call_node->children.push_back(parse_expression(tokens));
+    } while (match(tokens, TokenType::COMMA));
+
+    if (!match(tokens, TokenType::RIGHT_PAREN)) {
+        return syntax_error("Syntax error, expected closing parenthesis after arguments to '" + identifier.value + "'.");
+    }
+
+    return call_node;
+}
+
 std::shared_ptr<ASTNode> parse_factor(const std::vector<Token>* tokens)
 {
+    if (peek(tokens).type == TokenType::IDENTIFIER && peek(tokens, 1).type == TokenType::LEFT_PAREN) {
+        return parse_call(tokens);
+    }
+
+    if (match(tokens, TokenType::BANG)) {
+        std::shared_ptr<ASTNode> not_node = std::make_shared<ASTNode>(NodeType::LogicalOperator, "!");
+        not_node->children.push_back(parse_factor(tokens));
+
+        return not_node;
+    }
+
+    if (match(tokens, TokenType::OPERATOR_MINUS)) {
+        std::shared_ptr<ASTNode> operand = parse_factor(tokens);
+
+        // fold the sign into literals right away, e.g. for 'x / -3'
+        if (operand->type == NodeType::Number) {
+            operand->number = (int64_t) (0 - (uint64_t) operand->number);
+            operand->value = "-" + operand->value;
+
+            return operand;
+        }
+
+        std::shared_ptr<ASTNode> negation_node = std::make_shared<ASTNode>(NodeType::BinaryOperator, "-");
+        negation_node->children.push_back(std::make_shared<ASTNode>(NodeType::Number, "0"));
+        negation_node->children.push_back(operand);
+
+        return negation_node;
+    }
+
     if (match(tokens, TokenType::INT_LIT)) {
-        return std::make_shared<ASTNode>(NodeType::Number, tokens->at(current - 1).value);
+        auto number_node = std::make_shared<ASTNode>(NodeType::Number, tokens->at(current - 1).value);
+        number_node->number = tokens->at(current - 1).number;
+
+        return number_node;
     }
 
     if (match(tokens, TokenType::STRING)) {
@@ -72,15 +144,13 @@ std::shared_ptr<ASTNode> parse_factor(const std::vector<Token>* tokens)
         std::shared_ptr<ASTNode> inner = parse_expression(tokens);
 
         if (!match(tokens, TokenType::RIGHT_PAREN)) {
-            printf("No matching closing parentheses found.\n");
-            exit(EXIT_FAILURE);
+            return syntax_error("No matching closing parentheses found.");
         }
 
         return inner;
     }
 
-    printf("UNEXPECTED FACTOR");
-    exit(EXIT_FAILURE);
+    return syntax_error("UNEXPECTED FACTOR");
 }
 
 std::shared_ptr<ASTNode> parse_term(const std::vector<Token>* tokens)
@@ -107,7 +177,7 @@ std::shared_ptr<ASTNode> parse_term(const std::vector<Token>* tokens)
     return node;
 }
 
-std::shared_ptr<ASTNode> parse_expression(const std::vector<Token>* tokens)
+std::shared_ptr<ASTNode> parse_comparison(const std::vector<Token>* tokens)
 {
     std::shared_ptr<ASTNode> node = parse_term(tokens);
 
@@ -163,8 +233,124 @@ std::shared_ptr<ASTNode> parse_expression(const std::vector<Token>* tokens)
     return node;
 }
 
+std::shared_ptr<ASTNode> parse_logical_and(const std::vector<Token>* tokens)
+{
+    std::shared_ptr<ASTNode> node = parse_comparison(tokens);
+
+    while (match(tokens, TokenType::LOGICAL_AND)) {
+        std::shared_ptr<ASTNode> and_node = std::make_shared<ASTNode>(NodeType::LogicalOperator, "&&");
+        and_node->children.push_back(node);
+        and_node->children.push_back(parse_comparison(tokens));
+        node = and_node;
+    }
+
+    return node;
+}
+
+// || binds loosest, so a || b && c is a || (b && c)
+std::shared_ptr<ASTNode> parse_expression(const std::vector<Token>* tokens)
+{
+    std::shared_ptr<ASTNode> node = parse_logical_and(tokens);
+
+    while (match(tokens, TokenType::LOGICAL_OR)) {
+        std::shared_ptr<ASTNode> or_node = std::make_shared<ASTNode>(NodeType::LogicalOperator, "||");
+        or_node->children.push_back(node);
+        or_node->children.push_back(parse_logical_and(tokens));
+        node = or_node;
+    }
+
+    return node;
+}
+
+// fn name(a, b) { ... }, the parameters become Identifier children and the
+// body is always the last child
+std::shared_ptr<ASTNode> parse_function(const std::vector<Token>* tokens)
+{
+    advance(tokens); // discard fn keyword
+
+    Token identifier = advance(tokens);
+    if (identifier.type != TokenType::IDENTIFIER) {
+        return syntax_error("Syntax error, expected function name after 'fn'.");
+    }
+
+    if (!match(tokens, TokenType::LEFT_PAREN)) {
+        return syntax_error("Syntax error, expected parameter list after function name '" + identifier.value + "'.");
+    }
+
+    std::shared_ptr<ASTNode> function_node = std::make_shared<ASTNode>(NodeType::Function, identifier.value);
+
+    if (!match(tokens, TokenType::RIGHT_PAREN)) {
+        do {
+            Token parameter = advance(tokens);
+            if (parameter.type != TokenType::IDENTIFIER) {
+                return syntax_error("Syntax error, expected parameter name in function '" + identifier.value + "'.");
+            }
+
+            function_node->children.push_back(std::make_shared<ASTNode>(NodeType::Identifier, parameter.value));
+        } while (match(tokens, TokenType::COMMA));
+
+        if (!match(tokens, TokenType::RIGHT_PAREN)) {
+            return syntax_error("Syntax error, expected closing parenthesis after parameters of '" + identifier.value + "'.");
+        }
+    }
+
+    if (!match(tokens, TokenType::LEFT_BRACE)) {
+        return syntax_error("Syntax error, expected opening brace for body of '" + identifier.value + "'.");
+    }
+
+    function_node->children.push_back(parse_block(tokens));
+
+    return function_node;
+}
+
+// the statements up to and including the closing brace, the opening brace has
+// already been consumed and is counted into the block's tokens
+std::shared_ptr<ASTNode> parse_block(const std::vector<Token>* tokens)
+{
+    int first = current - 1;
+    std::shared_ptr<ASTNode> block_node = std::make_shared<ASTNode>(NodeType::Block, "");
+
+    while (parser_error.empty() && !match(tokens, TokenType::RIGHT_BRACE)) {
+        block_node->children.push_back(parse_statement(tokens));
+    }
+
+    block_node->tokens = current - first;
+
+    return block_node;
+}
+
 std::shared_ptr<ASTNode> parse_statement(const std::vector<Token>* tokens)
 {
+    int first = current;
+
+    std::shared_ptr<ASTNode> node = parse_statement_node(tokens);
+    node->tokens = current - first;
+
+    return node;
+}
+
+std::shared_ptr<ASTNode> parse_statement_node(const std::vector<Token>* tokens)
+{
+    if (peek(tokens).type == TokenType::FN) {
+        return parse_function(tokens);
+    }
+
+    if (peek(tokens).type == TokenType::RETURN) {
+        advance(tokens);
+
+        std::shared_ptr<ASTNode> return_node = std::make_shared<ASTNode>(NodeType::Return, "");
+
+        if (peek(tokens).type != TokenType::RIGHT_BRACE) {
+            return_node->children.push_back(parse_expression(tokens));
+        }
+
+        return return_node;
+    }
+
+    if (peek(tokens).type == TokenType::IDENTIFIER && peek(tokens, 1).type == TokenType::LEFT_PAREN) {
+        return parse_call(tokens);
+    }
+
     if (peek(tokens).type == TokenType::IDENTIFIER && peek(tokens, 1).type == TokenType::ASSIGNMENT) {
         Token identifier_node = advance(tokens);
         advance(tokens); // discard assignment operator
@@ -189,36 +375,20 @@ std::shared_ptr<ASTNode> parse_statement(const std::vector<Token>* tokens)
         node->children.push_back(if_expression);
 
         if (peek(tokens).type != TokenType::LEFT_BRACE) {
-            printf("Syntax error, expected opening brace after conditional expression.\n");
-            exit(EXIT_FAILURE);
+            return syntax_error("Syntax error, expected opening brace after conditional expression.");
         }
 
         advance(tokens); // skip the first brace
 
-        std::shared_ptr<ASTNode> block_node = std::make_shared<ASTNode>(NodeType::Block, "");
-
-        while (!match(tokens, TokenType::RIGHT_BRACE)) {
-            std::shared_ptr<ASTNode> child_statement = parse_statement(tokens);
-
-            block_node->children.push_back(child_statement);
-        }
-
-        node->children.push_back(block_node);
+        node->children.push_back(parse_block(tokens));
 
         if (peek(tokens).type == TokenType::ELSE && peek(tokens, 1).type == TokenType::LEFT_BRACE) {
             std::shared_ptr<ASTNode> else_node = std::make_shared<ASTNode>(NodeType::Else, "");
-            std::shared_ptr<ASTNode> else_block_node = std::make_shared<ASTNode>(NodeType::Block, "");
-
-            else_node->children.push_back(else_block_node);
 
             advance(tokens);
             advance(tokens);
 
-            while (!match(tokens, TokenType::RIGHT_BRACE)) {
-                std::shared_ptr<ASTNode> else_child_statement = parse_statement(tokens);
-
-                else_block_node->children.push_back(else_child_statement);
-            }
+            else_node->children.push_back(parse_block(tokens));
 
             node->children.push_back(else_node);
         }
@@ -226,20 +396,34 @@ std::shared_ptr<ASTNode> parse_statement(const std::vector<Token>* tokens)
         return node;
     }
 
+    if (peek(tokens).type == TokenType::WHILE && peek(tokens, 1).type == TokenType::LEFT_PAREN) {
+        std::shared_ptr<ASTNode> node = std::make_shared<ASTNode>(NodeType::While, "");
+        advance(tokens);
+
+        node->children.push_back(parse_expression(tokens));
+
+        if (!match(tokens, TokenType::LEFT_BRACE)) {
+            return syntax_error("Syntax error, expected opening brace after loop condition.");
+        }
+
+        node->children.push_back(parse_block(tokens));
+
+        return node;
+    }
+
     if (peek(tokens).type == TokenType::ASM) {
         auto directive_node = std::make_shared<ASTNode>(NodeType::Directive, "asm");
         advance(tokens);
 
         if (peek(tokens).type != TokenType::LEFT_BRACE) {
-            printf("Syntax error, expected block after compiler directive.\n");
-            exit(EXIT_FAILURE);
+            return syntax_error("Syntax error, expected block after compiler directive.");
         }
 
         advance(tokens);
 
         std::shared_ptr<ASTNode> block_node = std::make_shared<ASTNode>(NodeType::Block, "");
 
-        while (!match(tokens, TokenType::RIGHT_BRACE)) {
+        while (parser_error.empty() && !match(tokens, TokenType::RIGHT_BRACE)) {
             std::shared_ptr<ASTNode> child_statement = parse_factor(tokens);
 
             block_node->children.push_back(child_statement);
@@ -252,22 +436,30 @@ std::shared_ptr<ASTNode> parse_statement(const std::vector<Token>* tokens)
 
     auto token = peek(tokens);
 
-    printf("\n\x1b[31m[error 1]\033[0m: %s was not expected here.\n", print_token_type(token.type));
-    printf("\t-> test.ion:%d:%d\n", token.line, token.character);
-    printf("\n");
-
-    exit(EXIT_FAILURE);
+    return syntax_error(std::string("\n\x1b[31m[error 1]\033[0m: ") + print_token_type(token.type) + " was not expected here.\n"
+        + "\t-> test.ion:" + std::to_string(token.line) + ":" + std::to_string(token.character) + "\n");
 
     // return parse_expression(tokens);
 }
 
+std::shared_ptr<ASTNode> parse_statement_at(const std::vector<Token>* tokens, int first, int& next)
+{
+    current = first;
+
+    std::shared_ptr<ASTNode> node = parse_statement(tokens);
+    next = current;
+
+    return node;
+}
+
 const std::shared_ptr<ASTNode> parse(const std::vector<Token>* tokens)
 {
     current = 0;
+    parser_error.clear();
 
     std::shared_ptr<ASTNode> root_node = std::make_shared<ASTNode>(NodeType::Root, "");
 
-    while (peek(tokens).type != TokenType::_EOF) {
+    while (parser_error.empty() && peek(tokens).type != TokenType::_EOF) {
         auto statement_node = parse_statement(tokens);
 
         root_node->children.push_back(statement_node);
@@ -285,3 +477,13 @@ void print_ast(const std::shared_ptr<ASTNode>& node, int depth)
         print_ast(child, depth + 1);
     }
 }
+
+int count_nodes(const std::shared_ptr<ASTNode>& node)
+{
+    int count = 1;
+    for (const auto& child : node->children) {
+        count += count_nodes(child);
+    }
+
+    return count;
+}
@@ -19,27 +19,53 @@ enum NodeType : uint8_t {
     Block,
     Directive,
     String,
+    Function,
+    Call,
+    Return,
+    LogicalOperator,
+    While,
 };
 
 struct ASTNode {
     NodeType type;
+
+    // statements and blocks only, how many tokens they were parsed from
+    int tokens = 0;
+
     std::string value;
+    int64_t number = 0; // Number only
     std::vector<std::shared_ptr<ASTNode>> children;
 
     ASTNode(const NodeType& type, const std::string& value) : type(type), value(value) {}
 };
 
+// the first error since parse started or it was last cleared. the parser
+// stops at it and the tree it returns has stand-ins in it, so it's only good
+// while this is empty
+extern std::string parser_error;
+
 Token peek(const std::vector<Token>* tokens, int lookahead);
 Token advance(const std::vector<Token>* tokens);
 const bool match(const std::vector<Token>* tokens, TokenType type);
 
+std::shared_ptr<ASTNode> parse_call(const std::vector<Token>* tokens);
 std::shared_ptr<ASTNode> parse_factor(const std::vector<Token>* tokens);
 std::shared_ptr<ASTNode> parse_term(const std::vector<Token>* tokens);
+std::shared_ptr<ASTNode> parse_comparison(const std::vector<Token>* tokens);
+std::shared_ptr<ASTNode> parse_logical_and(const std::vector<Token>* tokens);
 std::shared_ptr<ASTNode> parse_expression(const std::vector<Token>* tokens);
+std::shared_ptr<ASTNode> parse_function(const std::vector<Token>* tokens);
+std::shared_ptr<ASTNode> parse_block(const std::vector<Token>* tokens);
 std::shared_ptr<ASTNode> parse_statement(const std::vector<Token>* tokens);
+std::shared_ptr<ASTNode> parse_statement_node(const std::vector<Token>* tokens);
+
+// parses the one statement that starts at token first, next is set to the
+// token after it. parser_error isn't cleared first
+std::shared_ptr<ASTNode> parse_statement_at(const std::vector<Token>* tokens, int first, int& next);
 
 const std::shared_ptr<ASTNode> parse(const std::vector<Token>* tokens);
 
 void print_ast(const std::shared_ptr<ASTNode>& node, int depth);
+int count_nodes(const std::shared_ptr<ASTNode>& node);
 
 #endif
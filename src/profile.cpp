@@ -0,0 +1,72 @@
+#include <cstdio>
+#include <fstream>
+
+#include "profile.hpp"
+
+uint64_t fnv1a(uint64_t hash, const void* data, size_t length)
+{
+    const uint8_t* bytes = (const uint8_t*) data;
+
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+uint64_t program_hash(const FlatAST& ast)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    hash = fnv1a(hash, ast.nodes, ast.size() * sizeof(FlatNode));
+
+    // every string with its NUL, in table order
+    hash = fnv1a(hash, ast.string_data, ast.header->string_bytes);
+
+    return hash;
+}
+
+bool load_profile(const char* path, const FlatAST& ast, Profile& profile)
+{
+    std::ifstream input(path, std::ios::binary);
+    if (!input.is_open()) {
+        printf("Could not read profile %s, ignoring it.\n", path);
+        return false;
+    }
+
+    uint64_t header[4];
+    if (!input.read((char*) header, sizeof(header)) || header[0] != profile_magic || header[1] != profile_version) {
+        printf("%s is not a profile, ignoring it.\n", path);
+        return false;
+    }
+
+    if (header[2] != program_hash(ast)) {
+        printf("Profile %s was recorded for a different program, ignoring it.\n", path);
+        return false;
+    }
+
+    // the generator numbers every if, so that's how many counters a profile
+    // for this tree has. the count is checked before anything is allocated
+    uint64_t ifs = 0;
+    for (uint32_t i = 0; i < ast.size(); i++) {
+        ifs += ast.nodes[i].type == NodeType::If;
+    }
+
+    input.seekg(0, std::ios::end);
+    uint64_t file_size = (uint64_t) input.tellg();
+    input.seekg(sizeof(header), std::ios::beg);
+
+    if (header[3] != ifs || file_size != sizeof(header) + ifs * sizeof(BranchCounts)) {
+        printf("Profile %s doesn't have one counter per if, ignoring it.\n", path);
+        return false;
+    }
+
+    profile.branches.resize(ifs);
+    if (!input.read((char*) profile.branches.data(), ifs * sizeof(BranchCounts))) {
+        printf("Profile %s is truncated, ignoring it.\n", path);
+        profile.branches.clear();
+        return false;
+    }
+
+    return true;
+}
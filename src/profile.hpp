@@ -0,0 +1,36 @@
+#ifndef PROFILE_HPP
+#define PROFILE_HPP
+
+#include <cstdint>
+#include <vector>
+
+#include "flat_ast.hpp"
+
+// an instrumented program writes its branch counters here when it exits
+#define PROFILE_PATH "./build/program.profile"
+
+// the profile file is what the instrumented program dumps from memory, all
+// little endian 64 bit words: the magic, the format version, the hash of the
+// tree it was built from, the number of ifs and then two counters per if in
+// the order the generator reaches them: how often the if was reached and how
+// often its then block ran
+static const uint64_t profile_magic = 0x00464f52504e4f49; // "IONPROF"
+static const uint64_t profile_version = 1;
+
+struct BranchCounts {
+    uint64_t reached;
+    uint64_t then_count;
+};
+
+struct Profile {
+    std::vector<BranchCounts> branches;
+};
+
+// identifies the tree a profile belongs to, any change to the program or to
+// what the optimizer makes of it gives a different hash
+uint64_t program_hash(const FlatAST& ast);
+
+// returns false with a message printed if the file can't be used for ast
+bool load_profile(const char* path, const FlatAST& ast, Profile& profile);
+
+#endif
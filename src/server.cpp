@@ -0,0 +1,799 @@
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <deque>
+#include <unordered_map>
+#include <vector>
+
+#include "server.hpp"
+
+#if defined (__APPLE__)
+    #define MODIFIED(info) (info).st_mtimespec
+#else
+    #define MODIFIED(info) (info).st_mtim
+#endif
+
+// requests are a handful of paths and flags, anything bigger is garbage
+static const uint32_t max_request_size = 64 * 1024;
+
+// dropped all at once when it grows past this, it's refilled on the next
+// request for each file anyway
+static const size_t max_cached_bytes = 64 * 1024 * 1024;
+
+// connections whose request hasn't started yet, further ones wait in the
+// backlog
+static const size_t max_pending_requests = 64;
+
+// a client that connects and then says nothing is dropped after this long
+static const int request_timeout_seconds = 5;
+
+struct CachedSource {
+    std::string contents;
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    struct timespec modified;
+};
+
+// what a worker sends back through its pipe after reading a source the cache
+// didn't have, followed by the resolved path and the contents
+struct SourceMessage {
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    struct timespec modified;
+    uint32_t path_length;
+};
+
+// a connection whose request is still coming in, read whenever the client
+// has sent more so a slow one doesn't hold up the others
+struct PendingRequest {
+    int client;
+    std::chrono::steady_clock::time_point deadline;
+
+    uint32_t length = 0;
+    size_t length_received = 0;
+
+    // the working directory followed by the arguments, each NUL terminated
+    std::vector<char> data;
+    size_t received = 0;
+};
+
+enum RequestState : uint8_t {
+    RequestReading,
+    RequestComplete,
+    RequestBroken,
+};
+
+std::unordered_map<std::string, CachedSource> source_cache;
+size_t cached_bytes = 0;
+
+int signal_pipe[2] = { -1, -1 };
+volatile sig_atomic_t stopping = 0;
+
+// a directory only this user can write to, so nobody else can put a socket
+// of their own where ours is expected. lstat, so a symlink doesn't count
+bool private_directory(const std::string& directory)
+{
+    struct stat info;
+
+    return lstat(directory.c_str(), &info) == 0 && S_ISDIR(info.st_mode) && info.st_uid == geteuid() && (info.st_mode & 077) == 0;
+}
+
+// whether the process on the other end of a unix socket runs as this user.
+// anyone who can reach the socket could connect otherwise, and have their
+// requests compiled as us
+bool peer_is_user(int fd)
+{
+    uid_t uid;
+
+#if defined (__APPLE__)
+    gid_t group;
+    if (getpeereid(fd, &uid, &group) != 0) {
+        return false;
+    }
+#else
+    struct ucred credentials;
+    socklen_t length = sizeof(credentials);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) != 0 || length != sizeof(credentials)) {
+        return false;
+    }
+    uid = credentials.uid;
+#endif
+
+    return uid == geteuid();
+}
+
+std::string default_socket_path()
+{
+    const char* runtime = getenv("XDG_RUNTIME_DIR");
+    std::string directory;
+
+    if (runtime != nullptr && runtime[0] == '/') {
+        directory = runtime;
+    } else {
+        directory = "/tmp/ion-" + std::to_string(geteuid());
+
+        if (mkdir(directory.c_str(), 0700) != 0 && errno != EEXIST) {
+            printf("Could not create '%s' for the compile server socket.\n", directory.c_str());
+            return std::string();
+        }
+    }
+
+    if (!private_directory(directory)) {
+        printf("'%s' isn't a directory private to this user, not using it for the compile server socket.\n", directory.c_str());
+        return std::string();
+    }
+
+    return directory + "/ion.sock";
+}
+
+bool same_file(const CachedSource& source, const struct stat& info)
+{
+    return source.device == info.st_dev && source.inode == info.st_ino && source.size == info.st_size
+        && source.modified.tv_sec == MODIFIED(info).tv_sec && source.modified.tv_nsec == MODIFIED(info).tv_nsec;
+}
+
+const std::string* find_cached_source(const char* path)
+{
+    char resolved[PATH_MAX];
+    struct stat info;
+
+    if (source_cache.empty() || realpath(path, resolved) == nullptr || stat(resolved, &info) != 0) {
+        return nullptr;
+    }
+
+    auto source = source_cache.find(resolved);
+    if (source == source_cache.end() || !same_file(source->second, info)) {
+        return nullptr;
+    }
+
+    return &source->second.contents;
+}
+
+// reads path unless the cached copy is still current, false if there was
+// nothing new to read. paths are resolved against the current directory,
+// which is the request's
+bool read_source(const char* path, std::string& resolved_path, CachedSource& loaded)
+{
+    char resolved[PATH_MAX];
+    struct stat info;
+
+    if (realpath(path, resolved) == nullptr || stat(resolved, &info) != 0 || !S_ISREG(info.st_mode)) {
+        return false;
+    }
+
+    auto source = source_cache.find(resolved);
+    if (source != source_cache.end() && same_file(source->second, info)) {
+        return false;
+    }
+
+    int file = open(resolved, O_RDONLY);
+    if (file < 0) {
+        return false;
+    }
+
+    loaded.contents.resize(info.st_size);
+
+    size_t total = 0;
+    while (total < loaded.contents.size()) {
+        ssize_t count = read(file, &loaded.contents[total], loaded.contents.size() - total);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            break;
+        }
+        total += count;
+    }
+    close(file);
+
+    // changed while being read, compile reads it itself instead
+    if (total != loaded.contents.size()) {
+        return false;
+    }
+
+    loaded.device = info.st_dev;
+    loaded.inode = info.st_ino;
+    loaded.size = info.st_size;
+    loaded.modified = MODIFIED(info);
+    resolved_path = resolved;
+
+    return true;
+}
+
+void store_source(const std::string& resolved, CachedSource&& loaded)
+{
+    auto source = source_cache.find(resolved);
+    if (source != source_cache.end()) {
+        cached_bytes -= source->second.contents.size();
+        source_cache.erase(source);
+    }
+
+    if (cached_bytes + loaded.contents.size() > max_cached_bytes) {
+        source_cache.clear();
+        cached_bytes = 0;
+    }
+
+    cached_bytes += loaded.contents.size();
+    source_cache.emplace(resolved, std::move(loaded));
+}
+
+bool write_all(int fd, const char* data, size_t length)
+{
+    while (length > 0) {
+        ssize_t count = write(fd, data, length);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        data += count;
+        length -= count;
+    }
+
+    return true;
+}
+
+// reads path in the worker if the server's cache doesn't have it yet and
+// hands it to the server through pipe, so the next request finds it. the
+// server never reads a source itself and can't be held up by a slow one
+void share_source(const char* path, int pipe)
+{
+    std::string resolved;
+    CachedSource loaded;
+
+    if (!read_source(path, resolved, loaded)) {
+        return;
+    }
+
+    SourceMessage message;
+    message.device = loaded.device;
+    message.inode = loaded.inode;
+    message.size = loaded.size;
+    message.modified = loaded.modified;
+    message.path_length = resolved.size();
+
+    if (write_all(pipe, (const char*) &message, sizeof(message)) && write_all(pipe, resolved.data(), resolved.size())) {
+        write_all(pipe, loaded.contents.data(), loaded.contents.size());
+    }
+
+    // compile finds it here as well
+    store_source(resolved, std::move(loaded));
+}
+
+// a complete message from share_source goes into the cache, anything cut
+// short is dropped
+void receive_source(const std::string& message)
+{
+    SourceMessage header;
+    if (message.size() < sizeof(header)) {
+        return;
+    }
+    memcpy(&header, message.data(), sizeof(header));
+
+    if (header.size < 0 || message.size() != sizeof(header) + header.path_length + (size_t) header.size) {
+        return;
+    }
+
+    CachedSource loaded;
+    loaded.device = header.device;
+    loaded.inode = header.inode;
+    loaded.size = header.size;
+    loaded.modified = header.modified;
+    loaded.contents = message.substr(sizeof(header) + header.path_length);
+
+    store_source(message.substr(sizeof(header), header.path_length), std::move(loaded));
+}
+
+// reads whatever the client has sent so far without waiting for more
+RequestState read_request(PendingRequest& request)
+{
+    while (true) {
+        bool in_length = request.length_received < sizeof(request.length);
+        char* target = in_length ? (char*) &request.length + request.length_received : request.data.data() + request.received;
+        size_t wanted = in_length ? sizeof(request.length) - request.length_received : request.data.size() - request.received;
+
+        ssize_t count = read(request.client, target, wanted);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return RequestState::RequestReading;
+        }
+        if (count <= 0) {
+            return RequestState::RequestBroken;
+        }
+
+        if (in_length) {
+            request.length_received += count;
+
+            if (request.length_received == sizeof(request.length)) {
+                if (request.length == 0 || request.length > max_request_size) {
+                    return RequestState::RequestBroken;
+                }
+                request.data.resize(request.length);
+            }
+        } else {
+            request.received += count;
+
+            if (request.received == request.data.size()) {
+                return request.data.back() == '\0' ? RequestState::RequestComplete : RequestState::RequestBroken;
+            }
+        }
+    }
+}
+
+// the reply is whatever the compile printed followed by its exit status in
+// the last four bytes, which the server adds once the worker has exited
+void send_status(int client, int32_t status)
+{
+    write_all(client, (const char*) &status, sizeof(status));
+    close(client);
+}
+
+void send_error(int client, const std::string& message)
+{
+    write_all(client, message.data(), message.size());
+    send_status(client, EXIT_FAILURE);
+}
+
+void on_signal(int signal)
+{
+    if (signal != SIGCHLD) {
+        stopping = 1;
+    }
+
+    // wakes up the poll in the main loop
+    int saved = errno;
+    char byte = 0;
+    ssize_t ignored = write(signal_pipe[1], &byte, 1);
+    (void) ignored;
+    errno = saved;
+}
+
+int open_listener(const std::string& path)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+
+    if (path.size() >= sizeof(address.sun_path)) {
+        printf("Socket path '%s' is too long.\n", path.c_str());
+        exit(EXIT_FAILURE);
+    }
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        printf("Could not create a socket, exiting...\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // a socket file nobody answers on is left over from a server that died
+    if (connect(listener, (struct sockaddr*) &address, sizeof(address)) == 0) {
+        printf("A compile server is already listening on '%s'.\n", path.c_str());
+        exit(EXIT_FAILURE);
+    }
+    close(listener);
+    unlink(path.c_str());
+
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr*) &address, sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0) {
+        printf("Could not listen on '%s', exiting...\n", path.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    fcntl(listener, F_SETFD, FD_CLOEXEC);
+    return listener;
+}
+
+// the source is the last argument that isn't an option, same as in main
+const char* find_source_path(const std::vector<char*>& arguments)
+{
+    const char* path = nullptr;
+
+    for (size_t i = 1; i < arguments.size(); i++) {
+        if (arguments[i][0] != '-') {
+            path = arguments[i];
+        }
+    }
+
+    return path;
+}
+
+// forks a worker for a request that has been read in full, returning its pid
+// or -1 if it couldn't be started. inherited are the descriptors of the other
+// clients and workers, which the worker closes. the source it reads comes
+// back through source_pipe
+pid_t start_request(PendingRequest& request, const std::vector<int>& inherited, int& source_pipe, int (*compile)(int argc, char** argv))
+{
+    static char program_name[] = "ion";
+    std::vector<char*> arguments;
+    arguments.push_back(program_name);
+
+    const char* directory = request.data.data();
+    for (size_t i = strlen(directory) + 1; i < request.data.size(); i += strlen(&request.data[i]) + 1) {
+        arguments.push_back(&request.data[i]);
+    }
+
+    const char* path = find_source_path(arguments);
+    arguments.push_back(nullptr);
+
+    int sources[2];
+    if (pipe(sources) != 0) {
+        send_error(request.client, "Could not start a worker.\n");
+        return -1;
+    }
+
+    // anything still buffered would be printed by the worker again
+    fflush(stdout);
+
+    pid_t worker = fork();
+
+    if (worker < 0) {
+        close(sources[0]);
+        close(sources[1]);
+        send_error(request.client, "Could not start a worker.\n");
+        return -1;
+    }
+
+    if (worker == 0) {
+        // the other clients only see the end of their reply once nothing
+        // holds their socket open any more
+        for (int fd : inherited) {
+            close(fd);
+        }
+        close(sources[0]);
+        close(signal_pipe[0]);
+        close(signal_pipe[1]);
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+
+        int client = request.client;
+        fcntl(client, F_SETFL, fcntl(client, F_GETFL) & ~O_NONBLOCK);
+        dup2(client, STDOUT_FILENO);
+        dup2(client, STDERR_FILENO);
+        close(client);
+
+        if (chdir(directory) != 0) {
+            printf("Could not change to directory '%s'.\n", directory);
+            fflush(stdout);
+            _exit(EXIT_FAILURE);
+        }
+
+        if (path != nullptr) {
+            share_source(path, sources[1]);
+        }
+        close(sources[1]);
+
+        int status = compile((int) arguments.size() - 1, arguments.data());
+        fflush(stdout);
+        _exit(status);
+    }
+
+    close(sources[1]);
+    fcntl(sources[0], F_SETFL, O_NONBLOCK);
+    fcntl(sources[0], F_SETFD, FD_CLOEXEC);
+    source_pipe = sources[0];
+
+    return worker;
+}
+
+int run_server(const ServerOptions& options, int (*compile)(int argc, char** argv))
+{
+    char directory[PATH_MAX];
+    if (getcwd(directory, sizeof(directory)) == nullptr) {
+        printf("Could not read the current directory, exiting...\n");
+        return EXIT_FAILURE;
+    }
+
+    // workers change directory, so the socket is named by its full path
+    std::string socket_path = options.socket_path;
+    if (socket_path[0] != '/') {
+        socket_path = std::string(directory) + "/" + socket_path;
+    }
+
+    int listener = open_listener(socket_path);
+
+    if (pipe(signal_pipe) != 0) {
+        printf("Could not create a pipe, exiting...\n");
+        return EXIT_FAILURE;
+    }
+    for (int fd : signal_pipe) {
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGCHLD, &action, nullptr);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    // a client that hangs up early mustn't kill the server or its workers
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("Listening on '%s' with %d workers.\n", socket_path.c_str(), options.jobs);
+    fflush(stdout);
+
+    std::unordered_map<pid_t, int> workers;
+    std::vector<PendingRequest> pending;
+    std::deque<PendingRequest> ready;
+
+    // the read end of each worker's source pipe and what came through it
+    std::unordered_map<int, std::string> source_pipes;
+
+    auto last_request = std::chrono::steady_clock::now();
+
+    while (true) {
+        int status;
+        pid_t finished;
+        while ((finished = waitpid(-1, &status, WNOHANG)) > 0) {
+            auto worker = workers.find(finished);
+            if (worker == workers.end()) {
+                continue;
+            }
+
+            send_status(worker->second, WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+            workers.erase(worker);
+            last_request = std::chrono::steady_clock::now();
+        }
+
+        if (stopping) {
+            for (auto& request : ready) {
+                send_error(request.client, "The compile server is stopping.\n");
+            }
+            ready.clear();
+        }
+
+        while (!ready.empty() && (int) workers.size() < options.jobs) {
+            std::vector<int> inherited = { listener };
+            for (const auto& worker : workers) {
+                inherited.push_back(worker.second);
+            }
+            for (const auto& request : pending) {
+                inherited.push_back(request.client);
+            }
+            for (const auto& request : ready) {
+                if (request.client != ready.front().client) {
+                    inherited.push_back(request.client);
+                }
+            }
+            for (const auto& source : source_pipes) {
+                inherited.push_back(source.first);
+            }
+
+            int source_pipe = -1;
+            pid_t worker = start_request(ready.front(), inherited, source_pipe, compile);
+            if (worker > 0) {
+                workers[worker] = ready.front().client;
+                source_pipes.emplace(source_pipe, std::string());
+            }
+            ready.pop_front();
+        }
+
+        if (stopping && workers.empty()) {
+            break;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        int timeout = -1;
+
+        if (workers.empty() && pending.empty() && ready.empty()) {
+            auto idle = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_request).count();
+            if (idle >= options.idle_seconds * 1000LL) {
+                break;
+            }
+            timeout = (int) (options.idle_seconds * 1000LL - idle);
+        }
+
+        for (const auto& request : pending) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(request.deadline - now).count();
+            if (timeout < 0 || left < timeout) {
+                timeout = left > 0 ? (int) left : 0;
+            }
+        }
+
+        // past the limit, new connections wait in the backlog until a request
+        // has started
+        bool accepting = !stopping && pending.size() + ready.size() < max_pending_requests;
+
+        std::vector<struct pollfd> descriptors;
+        descriptors.push_back({ signal_pipe[0], POLLIN, 0 });
+        descriptors.push_back({ listener, (short) (accepting ? POLLIN : 0), 0 });
+        for (const auto& request : pending) {
+            descriptors.push_back({ request.client, POLLIN, 0 });
+        }
+        for (const auto& source : source_pipes) {
+            descriptors.push_back({ source.first, POLLIN, 0 });
+        }
+
+        if (poll(descriptors.data(), descriptors.size(), timeout) < 0) {
+            continue;
+        }
+
+        if (descriptors[0].revents & POLLIN) {
+            char drained[64];
+            while (read(signal_pipe[0], drained, sizeof(drained)) > 0) {
+            }
+        }
+
+        now = std::chrono::steady_clock::now();
+
+        // the requests still coming in, each read as far as it has arrived
+        std::vector<PendingRequest> still_pending;
+
+        for (size_t i = 0; i < pending.size(); i++) {
+            PendingRequest& request = pending[i];
+            RequestState state = RequestState::RequestReading;
+
+            if (descriptors[2 + i].revents != 0) {
+                state = read_request(request);
+            }
+
+            if (state == RequestState::RequestComplete) {
+                ready.push_back(std::move(request));
+            } else if (state == RequestState::RequestBroken || now >= request.deadline) {
+                close(request.client);
+            } else {
+                still_pending.push_back(std::move(request));
+            }
+        }
+
+        size_t first_source = 2 + pending.size();
+        pending = std::move(still_pending);
+
+        std::vector<int> closed_sources;
+        size_t index = first_source;
+
+        for (auto& source : source_pipes) {
+            if (descriptors[index++].revents == 0) {
+                continue;
+            }
+
+            char buffer[64 * 1024];
+            ssize_t count;
+            while ((count = read(source.first, buffer, sizeof(buffer))) > 0) {
+                source.second.append(buffer, count);
+            }
+
+            if (count == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                receive_source(source.second);
+                closed_sources.push_back(source.first);
+            }
+        }
+
+        for (int fd : closed_sources) {
+            close(fd);
+            source_pipes.erase(fd);
+        }
+
+        if (descriptors[1].revents & POLLIN) {
+            int client = accept(listener, nullptr, nullptr);
+            if (client < 0) {
+                continue;
+            }
+
+            if (!peer_is_user(client)) {
+                close(client);
+                continue;
+            }
+
+            fcntl(client, F_SETFL, O_NONBLOCK);
+            fcntl(client, F_SETFD, FD_CLOEXEC);
+
+            PendingRequest request;
+            request.client = client;
+            request.deadline = now + std::chrono::seconds(request_timeout_seconds);
+            pending.push_back(std::move(request));
+
+            last_request = now;
+        }
+    }
+
+    for (const auto& request : pending) {
+        close(request.client);
+    }
+    for (const auto& source : source_pipes) {
+        close(source.first);
+    }
+
+    close(listener);
+    unlink(socket_path.c_str());
+
+    printf("Compile server on '%s' stopped.\n", socket_path.c_str());
+    return 0;
+}
+
+int run_client(const std::string& socket_path, int argc, char** argv)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+        printf("Socket path '%s' is too long.\n", socket_path.c_str());
+        return EXIT_FAILURE;
+    }
+    memcpy(address.sun_path, socket_path.c_str(), socket_path.size() + 1);
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0 || connect(server, (struct sockaddr*) &address, sizeof(address)) != 0) {
+        printf("Could not connect to the compile server at '%s'.\n", socket_path.c_str());
+        return EXIT_FAILURE;
+    }
+
+    // the output and exit status are only worth trusting from our own server
+    if (!peer_is_user(server)) {
+        printf("The compile server at '%s' belongs to another user.\n", socket_path.c_str());
+        close(server);
+        return EXIT_FAILURE;
+    }
+
+    char directory[PATH_MAX];
+    if (getcwd(directory, sizeof(directory)) == nullptr) {
+        printf("Could not read the current directory, exiting...\n");
+        return EXIT_FAILURE;
+    }
+
+    std::string request(directory, strlen(directory) + 1);
+    for (int i = 0; i < argc; i++) {
+        request.append(argv[i], strlen(argv[i]) + 1);
+    }
+
+    if (request.size() > max_request_size) {
+        printf("Too many arguments for the compile server.\n");
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    uint32_t length = request.size();
+    if (!write_all(server, (const char*) &length, sizeof(length)) || !write_all(server, request.data(), request.size())) {
+        printf("Could not send the request to the compile server.\n");
+        return EXIT_FAILURE;
+    }
+
+    std::string reply;
+    char buffer[4096];
+    while (true) {
+        ssize_t count = read(server, buffer, sizeof(buffer));
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            break;
+        }
+        reply.append(buffer, count);
+    }
+    close(server);
+
+    int32_t status;
+    if (reply.size() < sizeof(status)) {
+        printf("The compile server closed the connection without a result.\n");
+        return EXIT_FAILURE;
+    }
+
+    size_t output = reply.size() - sizeof(status);
+    memcpy(&status, reply.data() + output, sizeof(status));
+
+    fwrite(reply.data(), 1, output, stdout);
+    return status;
+}
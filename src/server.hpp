@@ -0,0 +1,38 @@
+#ifndef SERVER_HPP
+#define SERVER_HPP
+
+#include <string>
+
+struct ServerOptions {
+    std::string socket_path;
+
+    // compiles running at once, further requests wait until one finishes
+    int jobs;
+
+    // the server exits after this long without a request
+    int idle_seconds;
+};
+
+// one socket per user, so separate users don't share sources. it lives in
+// $XDG_RUNTIME_DIR or else /tmp/ion-<uid>, and only if that directory belongs
+// to this user and nobody else can write to it. empty if there's no such
+// directory, after saying why
+std::string default_socket_path();
+
+// listens on a unix socket and runs every request through compile in a worker
+// forked from this process, so each one starts with the sources it has already
+// read and can exit() on an error without taking the server down. there's no
+// pool of long-lived workers: compile keeps its state in globals and stops at
+// the first error, so a worker that outlived its request would carry both
+// into the next one. what stays warm is the server and its source cache
+int run_server(const ServerOptions& options, int (*compile)(int argc, char** argv));
+
+// sends the arguments and working directory to the server, prints whatever
+// the compile printed and returns its exit status
+int run_client(const std::string& socket_path, int argc, char** argv);
+
+// contents of path as the server last read it, or nullptr if it hasn't read
+// it or the file has changed since
+const std::string* find_cached_source(const char* path);
+
+#endif
@@ -0,0 +1,134 @@
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <sys/resource.h>
+
+#include "stats.hpp"
+
+Stats stats;
+
+// counted from the replaced global operator new below, so every container
+// and shared_ptr in the compiler shows up without having to thread an
+// allocator through anything
+std::atomic<uint64_t> allocations(0);
+std::atomic<uint64_t> allocation_bytes(0);
+
+void* operator new(std::size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    allocation_bytes.fetch_add(size, std::memory_order_relaxed);
+
+    void* memory = std::malloc(size == 0 ? 1 : size);
+    if (memory == nullptr) {
+        throw std::bad_alloc();
+    }
+
+    return memory;
+}
+
+void operator delete(void* memory) noexcept
+{
+    std::free(memory);
+}
+
+ScopedTimer::ScopedTimer(const char* phase) : name(phase), start(std::chrono::high_resolution_clock::now()) {}
+
+ScopedTimer::~ScopedTimer()
+{
+    auto elapsed = std::chrono::high_resolution_clock::now() - start;
+    record_phase(name, std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+}
+
+void record_phase(const char* name, long long microseconds)
+{
+    for (auto& phase : stats.phases) {
+        if (phase.name == name) {
+            phase.microseconds += microseconds;
+            return;
+        }
+    }
+
+    stats.phases.push_back({ name, microseconds });
+}
+
+long long phase_microseconds(const char* name)
+{
+    for (const auto& phase : stats.phases) {
+        if (phase.name == name) {
+            return phase.microseconds;
+        }
+    }
+
+    return 0;
+}
+
+uint64_t peak_rss_bytes()
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+
+#if defined (__APPLE__)
+    return usage.ru_maxrss;
+#else
+    // linux reports kilobytes
+    return usage.ru_maxrss * 1024ULL;
+#endif
+}
+
+uint64_t allocation_count()
+{
+    return allocations.load(std::memory_order_relaxed);
+}
+
+uint64_t allocated_bytes()
+{
+    return allocation_bytes.load(std::memory_order_relaxed);
+}
+
+void print_stats(StatsFormat format)
+{
+    long long total = 0;
+    for (const auto& phase : stats.phases) {
+        total += phase.microseconds;
+    }
+
+    double seconds = total / 1000000.0;
+    double throughput = seconds > 0 ? (stats.bytes_in / (1024.0 * 1024.0)) / seconds : 0;
+
+    if (format == StatsFormat::StatsJson) {
+        fprintf(stderr, "{\n  \"phases_us\": {");
+        for (size_t i = 0; i < stats.phases.size(); i++) {
+            fprintf(stderr, "%s\n    \"%s\": %lld", i == 0 ? "" : ",", stats.phases[i].name.c_str(), stats.phases[i].microseconds);
+        }
+        fprintf(stderr, "\n  },\n");
+        fprintf(stderr, "  \"total_us\": %lld,\n", total);
+        fprintf(stderr, "  \"throughput_mb_per_s\": %.3f,\n", throughput);
+        fprintf(stderr, "  \"bytes_in\": %llu,\n", (unsigned long long) stats.bytes_in);
+        fprintf(stderr, "  \"bytes_out\": %llu,\n", (unsigned long long) stats.bytes_out);
+        fprintf(stderr, "  \"tokens\": %llu,\n", (unsigned long long) stats.tokens);
+        fprintf(stderr, "  \"ast_nodes\": %llu,\n", (unsigned long long) stats.ast_nodes);
+        fprintf(stderr, "  \"instructions\": %llu,\n", (unsigned long long) stats.instructions);
+        fprintf(stderr, "  \"peak_rss_bytes\": %llu,\n", (unsigned long long) peak_rss_bytes());
+        fprintf(stderr, "  \"allocations\": %llu,\n", (unsigned long long) allocation_count());
+        fprintf(stderr, "  \"allocated_bytes\": %llu\n", (unsigned long long) allocated_bytes());
+        fprintf(stderr, "}\n");
+        return;
+    }
+
+    fprintf(stderr, "\n");
+    for (const auto& phase : stats.phases) {
+        fprintf(stderr, "%-16s %10lld μs\n", phase.name.c_str(), phase.microseconds);
+    }
+    fprintf(stderr, "%-16s %10lld μs (%.2f MB/s)\n", "total", total, throughput);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%-16s %10llu\n", "bytes in", (unsigned long long) stats.bytes_in);
+    fprintf(stderr, "%-16s %10llu\n", "bytes out", (unsigned long long) stats.bytes_out);
+    fprintf(stderr, "%-16s %10llu\n", "tokens", (unsigned long long) stats.tokens);
+    fprintf(stderr, "%-16s %10llu\n", "ast nodes", (unsigned long long) stats.ast_nodes);
+    fprintf(stderr, "%-16s %10llu\n", "instructions", (unsigned long long) stats.instructions);
+    fprintf(stderr, "%-16s %10llu KB\n", "peak rss", (unsigned long long) (peak_rss_bytes() / 1024));
+    fprintf(stderr, "%-16s %10llu (%llu bytes)\n", "allocations", (unsigned long long) allocation_count(), (unsigned long long) allocated_bytes());
+}
@@ -0,0 +1,51 @@
+#ifndef STATS_HPP
+#define STATS_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+enum StatsFormat : uint8_t {
+    StatsNone,
+    StatsText,
+    StatsJson,
+};
+
+struct PhaseTiming {
+    std::string name;
+    long long microseconds;
+};
+
+struct Stats {
+    std::vector<PhaseTiming> phases;
+
+    uint64_t bytes_in = 0;
+    uint64_t bytes_out = 0;
+    uint64_t tokens = 0;
+    uint64_t ast_nodes = 0;
+    uint64_t instructions = 0;
+};
+
+extern Stats stats;
+
+// times the enclosing scope and adds it to the named phase, so a phase that
+// runs more than once (e.g. per function) accumulates instead of duplicating
+struct ScopedTimer {
+    explicit ScopedTimer(const char* phase);
+    ~ScopedTimer();
+
+    const char* name;
+    std::chrono::high_resolution_clock::time_point start;
+};
+
+void record_phase(const char* name, long long microseconds);
+long long phase_microseconds(const char* name);
+
+uint64_t peak_rss_bytes();
+uint64_t allocation_count();
+uint64_t allocated_bytes();
+
+void print_stats(StatsFormat format);
+
+#endif